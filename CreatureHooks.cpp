@@ -13,6 +13,7 @@
 #include "ElunaBinding.h"
 #include "ElunaIncludes.h"
 #include "ElunaTemplate.h"
+#include "ElunaCreatureAI.h"
 
 using namespace Hooks;
 
@@ -154,7 +155,150 @@ bool Eluna::UpdateAI(Creature* me, const uint32 diff)
     LOCK_ELUNA;
     Push(me);
     Push(diff);
-    return CallAllFunctionsBool(CreatureEventBindings, CreatureUniqueBindings, CREATURE_EVENT_ON_AIUPDATE, me->GetEntry(), me->GET_GUID(), me->GetInstanceId());
+    return CallAllUpdateFunctions(CreatureEventBindings, CreatureUniqueBindings, CREATURE_EVENT_ON_AIUPDATE, me->GetEntry(), me->GET_GUID(), me->GetInstanceId(), me->GET_GUID(), diff);
+}
+
+bool Eluna::QueueAIUpdate(Creature* me, ElunaCreatureAI* ai, uint32 diff)
+{
+    if (!CreatureEventBindings->HasEvents(CREATURE_EVENT_ON_AIUPDATE_BATCH, me->GetEntry()))
+        return false;
+
+    Map* map = me->GetMap();
+    AIUpdateBatch* batch = NULL;
+    {
+        ElunaUtil::RWLockable::ReadGuard guard(aiUpdateBatchesLock.GetLock());
+        AIUpdateBatches::iterator it = aiUpdateBatches.find(map);
+        if (it != aiUpdateBatches.end())
+            batch = &it->second;
+    }
+
+    if (!batch)
+    {
+        ElunaUtil::RWLockable::WriteGuard guard(aiUpdateBatchesLock.GetLock());
+        batch = &aiUpdateBatches[map];
+    }
+
+    // Creatures of a map update on the map's thread, which is also the one calling the batch
+    batch->entries[me->GetEntry()].push_back(AIUpdateBatch::Queued(me->GET_GUID(), ai, diff));
+    return true;
+}
+
+// Returns the creature if it is still on the map with the AI it was queued with
+static Creature* GetQueuedCreature(Map* map, uint64 guid, ElunaCreatureAI* ai)
+{
+#ifndef TRINITY
+    Creature* creature = map->GetCreature(ObjectGuid(guid));
+#else
+    Creature* creature = sObjectAccessor->GetObjectInMap(ObjectGuid(guid), map, (Creature*)NULL);
+#endif
+    if (!creature || creature->AI() != ai)
+        return NULL;
+    return creature;
+}
+
+void Eluna::ProcessAIUpdateBatch(Map* map)
+{
+    // Called on every map update, skip the lock and lookup while no entry has batch handlers
+    if (!CreatureEventBindings->HasAnyEvents(CREATURE_EVENT_ON_AIUPDATE_BATCH))
+        return;
+
+    AIUpdateBatch* batch = NULL;
+    {
+        ElunaUtil::RWLockable::ReadGuard guard(aiUpdateBatchesLock.GetLock());
+        AIUpdateBatches::iterator it = aiUpdateBatches.find(map);
+        if (it != aiUpdateBatches.end())
+            batch = &it->second;
+    }
+
+    if (!batch)
+        return;
+
+    std::vector<Creature*> creatures;
+    std::vector<uint64> guids;
+    std::vector<ElunaCreatureAI*> ais;
+    std::vector<uint32> diffs;
+    std::vector<uint8> handled;
+
+    LOCK_ELUNA;
+    for (UNORDERED_MAP<uint32, std::vector<AIUpdateBatch::Queued> >::iterator it = batch->entries.begin(); it != batch->entries.end(); ++it)
+    {
+        std::vector<AIUpdateBatch::Queued>& queued = it->second;
+        if (queued.empty())
+            continue;
+
+        // Creatures removed from the map or given a new AI since they were queued are left out
+        creatures.clear();
+        guids.clear();
+        ais.clear();
+        diffs.clear();
+        for (std::vector<AIUpdateBatch::Queued>::const_iterator q = queued.begin(); q != queued.end(); ++q)
+        {
+            Creature* creature = GetQueuedCreature(map, q->guid, q->ai);
+            if (!creature)
+                continue;
+
+            creatures.push_back(creature);
+            guids.push_back(q->guid);
+            ais.push_back(q->ai);
+            diffs.push_back(q->diff);
+        }
+        queued.clear();
+
+        if (creatures.empty() || !CreatureEventBindings->HasEvents(CREATURE_EVENT_ON_AIUPDATE_BATCH, it->first))
+            continue;
+
+        lua_createtable(L, int(creatures.size()), 0);
+        for (size_t i = 0; i < creatures.size(); ++i)
+        {
+            Push(L, creatures[i]);
+            lua_rawseti(L, -2, int(i + 1));
+        }
+        ++push_counter;
+
+        lua_createtable(L, int(diffs.size()), 0);
+        for (size_t i = 0; i < diffs.size(); ++i)
+        {
+            Push(L, diffs[i]);
+            lua_rawseti(L, -2, int(i + 1));
+        }
+        ++push_counter;
+
+        handled.assign(creatures.size(), 0);
+        int number_of_arguments = push_counter;
+        // Stack: creatures, diffs
+
+        int number_of_functions = SetupStack(CreatureEventBindings, CREATURE_EVENT_ON_AIUPDATE_BATCH, it->first, number_of_arguments);
+        // Stack: event_id, creatures, diffs, traceback, [functions]
+
+        while (number_of_functions > 0)
+        {
+            int r = CallOneFunction(number_of_functions, number_of_arguments, 1);
+            --number_of_functions;
+            // Stack: event_id, creatures, diffs, traceback, [functions - 1], result
+
+            if (lua_istable(L, r))
+            {
+                for (size_t i = 0; i < handled.size(); ++i)
+                {
+                    lua_rawgeti(L, r, int(i + 1));
+                    if (lua_isboolean(L, -1) && lua_toboolean(L, -1))
+                        handled[i] = 1;
+                    lua_pop(L, 1);
+                }
+            }
+
+            lua_pop(L, 1);
+            // Stack: event_id, creatures, diffs, traceback, [functions - 1]
+        }
+
+        CleanUpStack(number_of_arguments);
+        // Stack: (empty)
+
+        // The handlers may have removed creatures or replaced their AI, look them up again before writing to the AI
+        for (size_t i = 0; i < ais.size(); ++i)
+            if (GetQueuedCreature(map, guids[i], ais[i]))
+                ais[i]->batchHandled = handled[i] != 0;
+    }
 }
 
 //Called for reaction at enter to combat if not in combat yet (enemy can be NULL)
@@ -10,6 +10,10 @@
 #include "Common.h"
 #include "LuaEngine.h"
 #include "ElunaUtility.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
 
 extern "C"
 {
@@ -22,38 +26,99 @@ extern "C"
 #pragma warning(disable:4503)
 #endif
 
+/*
+ * The functions registered to an event are kept in an immutable list that is shared with dispatch.
+ * Insert and Clear replace the list with a modified copy under the write lock,
+ *   while dispatch only takes a reference to the current list under the read lock.
+ *
+ * The function references are unreferenced explicitly when a binding is removed from the store.
+ * This is safe for lists still used by dispatch, because dispatch and the removal both happen under LOCK_ELUNA.
+ */
 class ElunaBind : public ElunaUtil::RWLockable
 {
 public:
+    // Time accumulated by an interval binding for each object or map it is called for.
+    // Only used while pushing the functions, which happens under LOCK_ELUNA
+    class IntervalState
+    {
+    public:
+        IntervalState() : generation(0), pruneSize(MIN_PRUNE_SIZE)
+        {
+        }
+
+        // Adds diff to the time of the key. Returns true with the accumulated time when the interval has passed
+        bool Accumulate(uint64 key, uint32 diff, uint32 interval, uint32& total)
+        {
+            // Objects that were not updated since the last prune are gone or out of sight, forget them
+            if (elapsed.size() >= pruneSize)
+            {
+                for (ElapsedMap::iterator it = elapsed.begin(); it != elapsed.end();)
+                {
+                    if (it->second.generation != generation)
+                        it = elapsed.erase(it);
+                    else
+                        ++it;
+                }
+                ++generation;
+                pruneSize = std::max<size_t>(size_t(MIN_PRUNE_SIZE), elapsed.size() * 2);
+            }
+
+            Elapsed& entry = elapsed[key];
+            entry.generation = generation;
+            entry.time += diff;
+            if (entry.time < interval)
+                return false;
+
+            total = entry.time;
+            entry.time = 0;
+            return true;
+        }
+
+    private:
+        static const size_t MIN_PRUNE_SIZE = 64;
+
+        struct Elapsed
+        {
+            Elapsed() : time(0), generation(0) { }
+            uint32 time;
+            uint32 generation;
+        };
+        typedef UNORDERED_MAP<uint64, Elapsed> ElapsedMap;
+
+        ElapsedMap elapsed;
+        uint32 generation;
+        size_t pruneSize;
+    };
+
     struct Binding
     {
         int functionReference;
-        bool isTemporary;
-        uint32 remainingShots;
-        Eluna& E;
+        // Shots left for temporary bindings, shared by all copies of the binding. NULL for permanent bindings
+        std::shared_ptr<std::atomic<uint32> > remainingShots;
+        // Milliseconds between calls of per update events, 0 to call on every update
+        uint32 interval;
+        std::shared_ptr<IntervalState> intervalState;
 
-        Binding(Eluna& _E, int funcRef, uint32 shots) :
+        Binding(int funcRef, uint32 shots, uint32 _interval = 0) :
             functionReference(funcRef),
-            isTemporary(shots != 0),
-            remainingShots(shots),
-            E(_E)
+            remainingShots(shots ? std::make_shared<std::atomic<uint32> >(shots) : std::shared_ptr<std::atomic<uint32> >()),
+            interval(_interval),
+            intervalState(_interval ? std::make_shared<IntervalState>() : std::shared_ptr<IntervalState>())
         {
         }
 
-        // Remove our function from the registry when the Binding is deleted.
-        ~Binding()
-        {
-            luaL_unref(E.L, LUA_REGISTRYINDEX, functionReference);
-        }
+        bool IsSpent() const { return remainingShots && remainingShots->load(std::memory_order_relaxed) == 0; }
     };
-    typedef std::vector<Binding*> FunctionRefVector;
-    typedef UNORDERED_MAP<int, FunctionRefVector> EventToFunctionsMap;
+    typedef std::vector<Binding> FunctionRefVector;
+    typedef std::shared_ptr<const FunctionRefVector> FunctionRefList;
+    typedef UNORDERED_MAP<int, FunctionRefList> EventToFunctionsMap;
 
     Eluna& E;
     const char* groupName;
 
-    ElunaBind(const char* bindGroupName, Eluna& _E) : E(_E), groupName(bindGroupName)
+    ElunaBind(const char* bindGroupName, Eluna& _E) : E(_E), groupName(bindGroupName), eventMask(0)
     {
+        memset(eventKeyCounts, 0, sizeof(eventKeyCounts));
     }
 
     virtual ~ElunaBind()
@@ -63,6 +128,122 @@ public:
 
     // unregisters all registered functions and clears all registered events from the bindings
     virtual void Clear() { };
+
+protected:
+    // Number of slots in the summaries of bind stores that have keys in addition to the event id
+    static const uint32 SUMMARY_SIZE = 1024;
+
+    static uint64 EventBit(int eventId)
+    {
+        ASSERT(eventId >= 0 && eventId < 64);
+        return uint64(1) << eventId;
+    }
+
+    // Pushes the functions of the list and uses up the shots of temporary bindings.
+    // In per update events interval bindings are skipped until their interval has passed, see Eluna::CallAllUpdateFunctions.
+    // Returns true if a binding ran out of shots and should be removed with RemoveSpent.
+    bool PushList(lua_State* L, const FunctionRefVector& list)
+    {
+        Eluna::UpdateContext* context = E.updateContext;
+        bool spent = false;
+        for (FunctionRefVector::const_iterator it = list.begin(); it != list.end(); ++it)
+        {
+            uint32 diff = context ? context->diff : 0;
+            if (it->interval && context && !it->intervalState->Accumulate(context->key, context->diff, it->interval, diff))
+                continue;
+
+            if (it->remainingShots)
+            {
+                uint32 shots = it->remainingShots->load(std::memory_order_relaxed);
+                do
+                {
+                    // Another dispatch used the last shot, the binding is waiting to be removed
+                    if (!shots)
+                        break;
+                } while (!it->remainingShots->compare_exchange_weak(shots, shots - 1, std::memory_order_relaxed));
+
+                if (!shots)
+                    continue;
+                if (shots == 1)
+                    spent = true;
+            }
+
+            lua_rawgeti(L, LUA_REGISTRYINDEX, it->functionReference);
+            if (context)
+                context->diffs.push_back(diff);
+        }
+        return spent;
+    }
+
+    // Returns a copy of the list with the given binding added
+    static FunctionRefList Append(const FunctionRefList& list, const Binding& binding)
+    {
+        std::shared_ptr<FunctionRefVector> copy = list ? std::make_shared<FunctionRefVector>(*list) : std::make_shared<FunctionRefVector>();
+        copy->push_back(binding);
+        return copy;
+    }
+
+    // Returns a copy of the list without the bindings that ran out of shots, or NULL if no bindings are left.
+    // The functions of the removed bindings are unreferenced. Must be called under the write lock
+    FunctionRefList RemoveSpent(const FunctionRefList& list)
+    {
+        std::shared_ptr<FunctionRefVector> copy = std::make_shared<FunctionRefVector>();
+        for (FunctionRefVector::const_iterator it = list->begin(); it != list->end(); ++it)
+        {
+            if (it->IsSpent())
+                luaL_unref(E.L, LUA_REGISTRYINDEX, it->functionReference);
+            else
+                copy->push_back(*it);
+        }
+        if (copy->empty())
+            return FunctionRefList();
+        return copy;
+    }
+
+    // Tells users of cached binding information that the bindings have changed
+    void BindingsChanged()
+    {
+        E.bindGeneration.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Unreferences the functions of all the bindings in the list. Must be called under the write lock
+    void Unref(const FunctionRefList& list)
+    {
+        for (FunctionRefVector::const_iterator it = list->begin(); it != list->end(); ++it)
+            luaL_unref(E.L, LUA_REGISTRYINDEX, it->functionReference);
+    }
+
+    // Counts a key (entry, guid and instance) that got bindings for the event and sets the event's bit in eventMask.
+    // Must be called under the write lock
+    void AddEventKey(int eventId)
+    {
+        if (!eventKeyCounts[eventId]++)
+            eventMask.fetch_or(EventBit(eventId), std::memory_order_relaxed);
+    }
+
+    // Uncounts a key that has no bindings for the event left, the event's bit is cleared when no keys are left.
+    // Must be called under the write lock
+    void RemoveEventKey(int eventId)
+    {
+        ASSERT(eventKeyCounts[eventId]);
+        if (!--eventKeyCounts[eventId])
+            eventMask.fetch_and(~EventBit(eventId), std::memory_order_relaxed);
+    }
+
+    // Forgets all counted keys. Must be called under the write lock
+    void ClearEventKeys()
+    {
+        memset(eventKeyCounts, 0, sizeof(eventKeyCounts));
+        eventMask.store(0, std::memory_order_relaxed);
+    }
+
+    // Bits of the event IDs that have bindings.
+    // Written under the write lock and read without any lock, so that checking for an event
+    //   that has no bindings does not need to lock or look up the maps.
+    std::atomic<uint64> eventMask;
+    // Number of keys with bindings for each event ID in stores that have keys in addition to the event id.
+    //   Keeps eventMask up to date when bindings are removed without going through all the keys.
+    uint32 eventKeyCounts[64];
 };
 
 template<typename T>
@@ -79,70 +260,74 @@ public:
         WriteGuard guard(GetLock());
 
         for (EventToFunctionsMap::iterator itr = Bindings.begin(); itr != Bindings.end(); ++itr)
-        {
-            FunctionRefVector& funcrefvec = itr->second;
-            for (FunctionRefVector::iterator it = funcrefvec.begin(); it != funcrefvec.end(); ++it)
-                delete *it;
-            funcrefvec.clear();
-        }
+            Unref(itr->second);
         Bindings.clear();
+        eventMask.store(0, std::memory_order_relaxed);
+        BindingsChanged();
     }
 
     void Clear(uint32 event_id)
     {
         WriteGuard guard(GetLock());
 
-        for (FunctionRefVector::iterator itr = Bindings[event_id].begin(); itr != Bindings[event_id].end(); ++itr)
-            delete *itr;
-        Bindings[event_id].clear();
+        EventToFunctionsMap::iterator itr = Bindings.find(event_id);
+        if (itr == Bindings.end())
+            return;
+
+        Unref(itr->second);
+        Bindings.erase(itr);
+        eventMask.fetch_and(~EventBit(event_id), std::memory_order_relaxed);
+        BindingsChanged();
     }
 
     // Pushes the function references and updates the counters on the binds and erases them if the counter would reach 0
     void PushFuncRefs(lua_State* L, int event_id)
     {
-        WriteGuard guard(GetLock());
-
-        for (FunctionRefVector::iterator it = Bindings[event_id].begin(); it != Bindings[event_id].end();)
+        FunctionRefList list;
         {
-            FunctionRefVector::iterator it_old = it++;
-            Binding* binding = (*it_old);
+            ReadGuard guard(GetLock());
 
-            lua_rawgeti(L, LUA_REGISTRYINDEX, binding->functionReference);
-
-            if (binding->isTemporary)
-            {
-                binding->remainingShots--;
-                if (binding->remainingShots == 0)
-                {
-                    delete binding;
-                    Bindings[event_id].erase(it_old);
-                }
-            }
+            EventToFunctionsMap::const_iterator itr = Bindings.find(event_id);
+            if (itr == Bindings.end())
+                return;
+            list = itr->second;
         }
 
-        if (Bindings[event_id].empty())
-            Bindings.erase(event_id);
+        if (!PushList(L, *list))
+            return;
+
+        WriteGuard guard(GetLock());
+
+        EventToFunctionsMap::iterator itr = Bindings.find(event_id);
+        if (itr == Bindings.end())
+            return;
+
+        itr->second = RemoveSpent(itr->second);
+        if (!itr->second)
+        {
+            Bindings.erase(itr);
+            eventMask.fetch_and(~EventBit(event_id), std::memory_order_relaxed);
+            BindingsChanged();
+        }
     };
 
-    void Insert(int eventId, int funcRef, uint32 shots) // Inserts a new registered event
+    void Insert(int eventId, int funcRef, uint32 shots, uint32 interval = 0) // Inserts a new registered event
     {
         WriteGuard guard(GetLock());
-        Bindings[eventId].push_back(new Binding(E, funcRef, shots));
+        FunctionRefList& list = Bindings[eventId];
+        list = Append(list, Binding(funcRef, shots, interval));
+        eventMask.fetch_or(EventBit(eventId), std::memory_order_relaxed);
+        BindingsChanged();
     }
 
     // Checks if there are events for ID
     bool HasEvents(T eventId)
     {
-        ReadGuard guard(GetLock());
-
         if (!E.IsEnabled())
             return false;
 
-        if (Bindings.empty())
-            return false;
-        if (Bindings.find(eventId) == Bindings.end())
-            return false;
-        return true;
+        // The event mask is exact for this store, no need to look at the map
+        return (eventMask.load(std::memory_order_relaxed) & EventBit(eventId)) != 0;
     }
 
     EventToFunctionsMap Bindings; // Binding store Bindings[eventId] = {(funcRef, counter)};
@@ -152,10 +337,15 @@ template<typename T>
 class EntryBind : public ElunaBind
 {
 public:
-    typedef UNORDERED_MAP<uint32, EventToFunctionsMap> EntryToEventsMap;
+    // Bindings are kept in a single map keyed by both the entry and the event id, see MakeKey
+    typedef UNORDERED_MAP<uint64, FunctionRefList> EntryEventToFunctionsMap;
+    typedef UNORDERED_MAP<uint32, uint64> EntryToEventMaskMap;
+    typedef UNORDERED_MAP<uint64, uint32> SlotEventToCountMap;
 
     EntryBind(const char* bindGroupName, Eluna& _E) : ElunaBind(bindGroupName, _E)
     {
+        for (uint32 i = 0; i < SUMMARY_SIZE; ++i)
+            entrySummary[i].store(0, std::memory_order_relaxed);
     }
 
     // unregisters all registered functions and clears all registered events from the bindmap
@@ -163,103 +353,203 @@ public:
     {
         WriteGuard guard(GetLock());
 
-        for (EntryToEventsMap::iterator itr = Bindings.begin(); itr != Bindings.end(); ++itr)
-        {
-            EventToFunctionsMap& funcmap = itr->second;
-            for (EventToFunctionsMap::iterator it = funcmap.begin(); it != funcmap.end(); ++it)
-            {
-                FunctionRefVector& funcrefvec = it->second;
-                for (FunctionRefVector::iterator i = funcrefvec.begin(); i != funcrefvec.end(); ++i)
-                    delete *i;
-                funcrefvec.clear();
-            }
-            funcmap.clear();
-        }
+        for (EntryEventToFunctionsMap::iterator itr = Bindings.begin(); itr != Bindings.end(); ++itr)
+            Unref(itr->second);
         Bindings.clear();
+        EntryEvents.clear();
+        SlotEventCounts.clear();
+        for (uint32 i = 0; i < SUMMARY_SIZE; ++i)
+            entrySummary[i].store(0, std::memory_order_relaxed);
+        ClearEventKeys();
+        BindingsChanged();
     }
 
     void Clear(uint32 entry, uint32 event_id)
     {
         WriteGuard guard(GetLock());
 
-        for (FunctionRefVector::iterator itr = Bindings[entry][event_id].begin(); itr != Bindings[entry][event_id].end(); ++itr)
-            delete *itr;
-        Bindings[entry][event_id].clear();
+        EntryEventToFunctionsMap::iterator itr = Bindings.find(MakeKey(entry, event_id));
+        if (itr == Bindings.end())
+            return;
+
+        Unref(itr->second);
+        Erase(itr, entry, event_id);
     }
 
     // Pushes the function references and updates the counters on the binds and erases them if the counter would reach 0
     void PushFuncRefs(lua_State* L, int event_id, uint32 entry)
     {
-        WriteGuard guard(GetLock());
-
-        for (FunctionRefVector::iterator it = Bindings[entry][event_id].begin(); it != Bindings[entry][event_id].end();)
+        uint64 key = MakeKey(entry, event_id);
+        FunctionRefList list;
         {
-            FunctionRefVector::iterator it_old = it++;
-            Binding* binding = (*it_old);
-
-            lua_rawgeti(L, LUA_REGISTRYINDEX, binding->functionReference);
+            ReadGuard guard(GetLock());
 
-            if (binding->isTemporary)
-            {
-                binding->remainingShots--;
-                if (binding->remainingShots == 0)
-                {
-                    delete binding;
-                    Bindings[entry][event_id].erase(it_old);
-                }
-            }
+            EntryEventToFunctionsMap::const_iterator itr = Bindings.find(key);
+            if (itr == Bindings.end())
+                return;
+            list = itr->second;
         }
 
-        if (Bindings[entry][event_id].empty())
-            Bindings[entry].erase(event_id);
+        if (!PushList(L, *list))
+            return;
+
+        WriteGuard guard(GetLock());
+
+        EntryEventToFunctionsMap::iterator itr = Bindings.find(key);
+        if (itr == Bindings.end())
+            return;
 
-        if (Bindings[entry].empty())
-            Bindings.erase(entry);
+        itr->second = RemoveSpent(itr->second);
+        if (!itr->second)
+            Erase(itr, entry, event_id);
     };
 
-    void Insert(uint32 entryId, int eventId, int funcRef, uint32 shots) // Inserts a new registered event
+    void Insert(uint32 entryId, int eventId, int funcRef, uint32 shots, uint32 interval = 0) // Inserts a new registered event
     {
         WriteGuard guard(GetLock());
-        Bindings[entryId][eventId].push_back(new Binding(E, funcRef, shots));
+        FunctionRefList& list = Bindings[MakeKey(entryId, eventId)];
+        list = Append(list, Binding(funcRef, shots, interval));
+
+        uint64 bit = EventBit(eventId);
+        uint64& events = EntryEvents[entryId];
+        if (!(events & bit))
+        {
+            events |= bit;
+            AddEventKey(eventId);
+
+            uint32 slot = entryId % SUMMARY_SIZE;
+            if (!SlotEventCounts[MakeKey(slot, eventId)]++)
+                entrySummary[slot].fetch_or(bit, std::memory_order_relaxed);
+        }
+        BindingsChanged();
     }
 
     // Returns true if the entry has registered binds
     bool HasEvents(T eventId, uint32 entryId)
     {
+        // Most checks are for events no entry, or no entry sharing the summary slot, has bindings for
+        uint64 bit = EventBit(eventId);
+        if (!(eventMask.load(std::memory_order_relaxed) & bit))
+            return false;
+        if (!(entrySummary[entryId % SUMMARY_SIZE].load(std::memory_order_relaxed) & bit))
+            return false;
+
         ReadGuard guard(GetLock());
 
-        if (Bindings.empty())
+        EntryToEventMaskMap::const_iterator itr = EntryEvents.find(entryId);
+        if (itr == EntryEvents.end())
             return false;
 
-        EntryToEventsMap::const_iterator itr = Bindings.find(entryId);
-        if (itr == Bindings.end())
-            return false;
+        return (itr->second & bit) != 0;
+    }
 
-        return itr->second.find(eventId) != itr->second.end();
+    // Returns true if any entry has bindings for the event, without locking
+    bool HasAnyEvents(T eventId)
+    {
+        return (eventMask.load(std::memory_order_relaxed) & EventBit(eventId)) != 0;
     }
 
     bool HasEvents(uint32 entryId)
     {
-        ReadGuard guard(GetLock());
-
         if (!E.IsEnabled())
             return false;
 
-        if (Bindings.empty())
+        if (!entrySummary[entryId % SUMMARY_SIZE].load(std::memory_order_relaxed))
             return false;
 
-        return Bindings.find(entryId) != Bindings.end();
+        ReadGuard guard(GetLock());
+
+        return EntryEvents.find(entryId) != EntryEvents.end();
+    }
+
+    // Returns the event bits of the events the entry has bindings for
+    uint64 GetEventMask(uint32 entryId)
+    {
+        if (!entrySummary[entryId % SUMMARY_SIZE].load(std::memory_order_relaxed))
+            return 0;
+
+        ReadGuard guard(GetLock());
+
+        EntryToEventMaskMap::const_iterator itr = EntryEvents.find(entryId);
+        if (itr == EntryEvents.end())
+            return 0;
+        return itr->second;
+    }
+
+    EntryEventToFunctionsMap Bindings; // Binding store Bindings[MakeKey(entryId, eventId)] = {(funcRef, counter)};
+    EntryToEventMaskMap EntryEvents; // Event bits of the events each entry has bindings for
+
+private:
+    static uint64 MakeKey(uint32 entry, uint32 event_id)
+    {
+        return (uint64(entry) << 32) | event_id;
     }
 
-    EntryToEventsMap Bindings; // Binding store Bindings[entryId][eventId] = {(funcRef, counter)};
+    // Erases the bindings of the event for the entry. Must be called under the write lock
+    // Only the entry's summary slot is updated, the other entries in the slot are counted in SlotEventCounts.
+    void Erase(EntryEventToFunctionsMap::iterator itr, uint32 entry, uint32 event_id)
+    {
+        Bindings.erase(itr);
+
+        uint64 bit = EventBit(event_id);
+        EntryToEventMaskMap::iterator it = EntryEvents.find(entry);
+        if (it != EntryEvents.end() && (it->second & bit))
+        {
+            it->second &= ~bit;
+            if (!it->second)
+                EntryEvents.erase(it);
+            RemoveEventKey(event_id);
+
+            uint32 slot = entry % SUMMARY_SIZE;
+            SlotEventToCountMap::iterator count = SlotEventCounts.find(MakeKey(slot, event_id));
+            ASSERT(count != SlotEventCounts.end() && count->second);
+            if (!--count->second)
+            {
+                SlotEventCounts.erase(count);
+                entrySummary[slot].fetch_and(~bit, std::memory_order_relaxed);
+            }
+        }
+        BindingsChanged();
+    }
+
+    // Event bits of all entries that map to the same slot, entrySummary[entryId % SUMMARY_SIZE]
+    std::atomic<uint64> entrySummary[SUMMARY_SIZE];
+    // Number of entries in a summary slot with bindings for the event, SlotEventCounts[MakeKey(slot, eventId)]
+    SlotEventToCountMap SlotEventCounts;
 };
 
 template<typename T>
 class UniqueBind : public ElunaBind
 {
 public:
-    typedef UNORDERED_MAP<uint32, EventToFunctionsMap> InstanceToEventsMap;
-    typedef UNORDERED_MAP<uint64, InstanceToEventsMap> GUIDToInstancesMap;
+    struct Key
+    {
+        uint64 guid;
+        uint32 instanceId;
+        uint32 eventId;
+
+        Key(uint64 _guid, uint32 _instanceId, uint32 _eventId) : guid(_guid), instanceId(_instanceId), eventId(_eventId) { }
+
+        bool operator==(const Key& other) const
+        {
+            return guid == other.guid && instanceId == other.instanceId && eventId == other.eventId;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            uint64 h = key.guid * 0x9E3779B97F4A7C15ULL;
+            h ^= (uint64(key.instanceId) << 8 | key.eventId) + (h >> 29);
+            return size_t(h ^ (h >> 32));
+        }
+    };
+
+    // Bindings are kept in a single map keyed by the guid, instance and event id.
+    // The event masks of guid and instance pairs are keyed with event id 0.
+    typedef UNORDERED_MAP<Key, FunctionRefList, KeyHash> KeyToFunctionsMap;
+    typedef UNORDERED_MAP<Key, uint64, KeyHash> KeyToEventMaskMap;
 
     UniqueBind(const char* bindGroupName, Eluna& _E) : ElunaBind(bindGroupName, _E)
     {
@@ -270,110 +560,131 @@ public:
     {
         WriteGuard guard(GetLock());
 
-        for (GUIDToInstancesMap::iterator iter = Bindings.begin(); iter != Bindings.end(); ++iter)
-        {
-            InstanceToEventsMap& eventsMap = iter->second;
-            for (InstanceToEventsMap::iterator itr = eventsMap.begin(); itr != eventsMap.end(); ++itr)
-            {
-                EventToFunctionsMap& funcmap = itr->second;
-                for (EventToFunctionsMap::iterator it = funcmap.begin(); it != funcmap.end(); ++it)
-                {
-                    FunctionRefVector& funcrefvec = it->second;
-                    for (FunctionRefVector::iterator i = funcrefvec.begin(); i != funcrefvec.end(); ++i)
-                        delete *i;
-                    funcrefvec.clear();
-                }
-                funcmap.clear();
-            }
-            eventsMap.clear();
-        }
+        for (typename KeyToFunctionsMap::iterator itr = Bindings.begin(); itr != Bindings.end(); ++itr)
+            Unref(itr->second);
         Bindings.clear();
+        InstanceEvents.clear();
+        ClearEventKeys();
+        BindingsChanged();
     }
 
     void Clear(uint64 guid, uint32 instanceId, uint32 event_id)
     {
         WriteGuard guard(GetLock());
-        FunctionRefVector& v = Bindings[guid][instanceId][event_id];
 
-        for (FunctionRefVector::iterator itr = v.begin(); itr != v.end(); ++itr)
-            delete *itr;
-        v.clear();
+        typename KeyToFunctionsMap::iterator itr = Bindings.find(Key(guid, instanceId, event_id));
+        if (itr == Bindings.end())
+            return;
+
+        Unref(itr->second);
+        Erase(itr);
     }
 
     // Pushes the function references and updates the counters on the binds and erases them if the counter would reach 0
     void PushFuncRefs(lua_State* L, int event_id, uint64 guid, uint32 instanceId)
     {
-        WriteGuard guard(GetLock());
-        FunctionRefVector& v = Bindings[guid][instanceId][event_id];
-
-        for (FunctionRefVector::iterator it = v.begin(); it != v.end();)
+        Key key(guid, instanceId, event_id);
+        FunctionRefList list;
         {
-            FunctionRefVector::iterator it_old = it++;
-            Binding* binding = (*it_old);
-
-            lua_rawgeti(L, LUA_REGISTRYINDEX, binding->functionReference);
+            ReadGuard guard(GetLock());
 
-            if (binding->isTemporary)
-            {
-                binding->remainingShots--;
-                if (binding->remainingShots == 0)
-                {
-                    delete binding;
-                    v.erase(it_old);
-                }
-            }
+            typename KeyToFunctionsMap::const_iterator itr = Bindings.find(key);
+            if (itr == Bindings.end())
+                return;
+            list = itr->second;
         }
 
-        if (Bindings[guid][instanceId][event_id].empty())
-            Bindings[guid][instanceId].erase(event_id);
+        if (!PushList(L, *list))
+            return;
 
-        if (Bindings[guid][instanceId].empty())
-            Bindings[guid].erase(instanceId);
+        WriteGuard guard(GetLock());
 
-        if (Bindings[guid].empty())
-            Bindings.erase(guid);
+        typename KeyToFunctionsMap::iterator itr = Bindings.find(key);
+        if (itr == Bindings.end())
+            return;
+
+        itr->second = RemoveSpent(itr->second);
+        if (!itr->second)
+            Erase(itr);
     };
 
-    void Insert(uint64 guid, uint32 instanceId, int eventId, int funcRef, uint32 shots) // Inserts a new registered event
+    void Insert(uint64 guid, uint32 instanceId, int eventId, int funcRef, uint32 shots, uint32 interval = 0) // Inserts a new registered event
     {
         WriteGuard guard(GetLock());
-        Bindings[guid][instanceId][eventId].push_back(new Binding(E, funcRef, shots));
+        FunctionRefList& list = Bindings[Key(guid, instanceId, eventId)];
+        list = Append(list, Binding(funcRef, shots, interval));
+
+        uint64& events = InstanceEvents[Key(guid, instanceId, 0)];
+        if (!(events & EventBit(eventId)))
+        {
+            events |= EventBit(eventId);
+            AddEventKey(eventId);
+        }
+        BindingsChanged();
     }
 
     // Returns true if the entry has registered binds
     bool HasEvents(T eventId, uint64 guid, uint32 instanceId)
     {
-        ReadGuard guard(GetLock());
-
-        if (Bindings.empty())
+        uint64 bit = EventBit(eventId);
+        if (!(eventMask.load(std::memory_order_relaxed) & bit))
             return false;
 
-        GUIDToInstancesMap::const_iterator itr = Bindings.find(guid);
-        if (itr == Bindings.end())
-            return false;
+        ReadGuard guard(GetLock());
 
-        InstanceToEventsMap::const_iterator it = itr->second.find(instanceId);
-        if (it == itr->second.end())
+        typename KeyToEventMaskMap::const_iterator itr = InstanceEvents.find(Key(guid, instanceId, 0));
+        if (itr == InstanceEvents.end())
             return false;
 
-        return it->second.find(eventId) != it->second.end();
+        return (itr->second & bit) != 0;
     }
 
     bool HasEvents(uint64 guid, uint32 instanceId)
     {
+        if (!eventMask.load(std::memory_order_relaxed))
+            return false;
+
         ReadGuard guard(GetLock());
 
-        if (Bindings.empty())
-            return false;
+        return InstanceEvents.find(Key(guid, instanceId, 0)) != InstanceEvents.end();
+    }
 
-        GUIDToInstancesMap::const_iterator itr = Bindings.find(guid);
-        if (itr == Bindings.end())
-            return false;
+    // Returns the event bits of the events the guid and instance have bindings for
+    uint64 GetEventMask(uint64 guid, uint32 instanceId)
+    {
+        if (!eventMask.load(std::memory_order_relaxed))
+            return 0;
 
-        return itr->second.find(instanceId) != itr->second.end();
+        ReadGuard guard(GetLock());
+
+        typename KeyToEventMaskMap::const_iterator itr = InstanceEvents.find(Key(guid, instanceId, 0));
+        if (itr == InstanceEvents.end())
+            return 0;
+        return itr->second;
     }
 
-    GUIDToInstancesMap Bindings; // Binding store Bindings[guid][instanceId][eventId] = {(funcRef, counter)};
+    KeyToFunctionsMap Bindings; // Binding store Bindings[Key(guid, instanceId, eventId)] = {(funcRef, counter)};
+    KeyToEventMaskMap InstanceEvents; // Event bits of the events each guid and instance has bindings for
+
+private:
+    // Erases the bindings of the key. Must be called under the write lock
+    void Erase(typename KeyToFunctionsMap::iterator itr)
+    {
+        Key key(itr->first.guid, itr->first.instanceId, 0);
+        uint32 eventId = itr->first.eventId;
+        uint64 bit = EventBit(eventId);
+        Bindings.erase(itr);
+
+        typename KeyToEventMaskMap::iterator it = InstanceEvents.find(key);
+        if (it != InstanceEvents.end() && (it->second & bit))
+        {
+            it->second &= ~bit;
+            if (!it->second)
+                InstanceEvents.erase(it);
+            RemoveEventKey(eventId);
+        }
+        BindingsChanged();
+    }
 };
 
 #endif
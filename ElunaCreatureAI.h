@@ -22,12 +22,33 @@ struct ElunaCreatureAI : ScriptedAI
 #define me  m_creature
 #endif
 
-    ElunaCreatureAI(Creature* creature) : ScriptedAI(creature)
+    // State dispatching the hooks of this creature, the state of its map when map states are used
+    Eluna* E;
+    // Bits (1 << event) of the events this creature has bindings for and the bind generation they were read at
+    uint64 eventMask;
+    uint32 eventGeneration;
+    // Result of the last CREATURE_EVENT_ON_AIUPDATE_BATCH call for this creature, set by Eluna::ProcessAIUpdateBatch
+    bool batchHandled;
+
+    ElunaCreatureAI(Creature* creature, Eluna* _E) : ScriptedAI(creature), E(_E), eventMask(0), eventGeneration(0), batchHandled(false)
     {
         JustRespawned();
     }
     ~ElunaCreatureAI() { }
 
+    // Returns true if the creature may have bindings for the event.
+    // The mask is read again only when bindings have been added or removed since it was last read.
+    bool HasEvent(Hooks::CreatureEvents evt)
+    {
+        uint32 generation = E->bindGeneration.load(std::memory_order_relaxed);
+        if (generation != eventGeneration)
+        {
+            eventMask = E->GetCreatureEventMask(me);
+            eventGeneration = generation;
+        }
+        return (eventMask & (uint64(1) << evt)) != 0;
+    }
+
     //Called at World update tick
 #ifndef TRINITY
     void UpdateAI(const uint32 diff) override
@@ -35,7 +56,18 @@ struct ElunaCreatureAI : ScriptedAI
     void UpdateAI(uint32 diff) override
 #endif
     {
-        if (!sEluna->UpdateAI(me, diff))
+        // Batches are called on the map update, after all creatures of the map have updated.
+        // Their result for this update is not known yet, the result of the last batch is applied instead, one update late
+        bool handled = false;
+        if (HasEvent(Hooks::CREATURE_EVENT_ON_AIUPDATE_BATCH) && E->QueueAIUpdate(me, this, diff))
+            handled = batchHandled;
+        else
+            batchHandled = false;
+
+        if (HasEvent(Hooks::CREATURE_EVENT_ON_AIUPDATE) && E->UpdateAI(me, diff))
+            handled = true;
+
+        if (!handled)
         {
 #ifdef TRINITY
             if (!me->HasFlag(UNIT_FIELD_FLAGS, UNIT_FLAG_IMMUNE_TO_NPC))
@@ -51,98 +83,101 @@ struct ElunaCreatureAI : ScriptedAI
     //Called at creature aggro either by MoveInLOS or Attack Start
     void EnterCombat(Unit* target) override
     {
-        if (!sEluna->EnterCombat(me, target))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_ENTER_COMBAT) || !E->EnterCombat(me, target))
             ScriptedAI::EnterCombat(target);
     }
 
     // Called at any Damage from any attacker (before damage apply)
     void DamageTaken(Unit* attacker, uint32& damage) override
     {
-        if (!sEluna->DamageTaken(me, attacker, damage))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_DAMAGE_TAKEN) || !E->DamageTaken(me, attacker, damage))
             ScriptedAI::DamageTaken(attacker, damage);
     }
 
     //Called at creature death
     void JustDied(Unit* killer) override
     {
-        if (!sEluna->JustDied(me, killer))
+        // Also calls CREATURE_EVENT_ON_RESET handlers
+        if (!(HasEvent(Hooks::CREATURE_EVENT_ON_DIED) || HasEvent(Hooks::CREATURE_EVENT_ON_RESET)) || !E->JustDied(me, killer))
             ScriptedAI::JustDied(killer);
     }
 
     //Called at creature killing another unit
     void KilledUnit(Unit* victim) override
     {
-        if (!sEluna->KilledUnit(me, victim))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_TARGET_DIED) || !E->KilledUnit(me, victim))
             ScriptedAI::KilledUnit(victim);
     }
 
     // Called when the creature summon successfully other creature
     void JustSummoned(Creature* summon) override
     {
-        if (!sEluna->JustSummoned(me, summon))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_JUST_SUMMONED_CREATURE) || !E->JustSummoned(me, summon))
             ScriptedAI::JustSummoned(summon);
     }
 
     // Called when a summoned creature is despawned
     void SummonedCreatureDespawn(Creature* summon) override
     {
-        if (!sEluna->SummonedCreatureDespawn(me, summon))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_SUMMONED_CREATURE_DESPAWN) || !E->SummonedCreatureDespawn(me, summon))
             ScriptedAI::SummonedCreatureDespawn(summon);
     }
 
     //Called at waypoint reached or PointMovement end
     void MovementInform(uint32 type, uint32 id) override
     {
-        if (!sEluna->MovementInform(me, type, id))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_REACH_WP) || !E->MovementInform(me, type, id))
             ScriptedAI::MovementInform(type, id);
     }
 
     // Called before EnterCombat even before the creature is in combat.
     void AttackStart(Unit* target) override
     {
-        if (!sEluna->AttackStart(me, target))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_PRE_COMBAT) || !E->AttackStart(me, target))
             ScriptedAI::AttackStart(target);
     }
 
     // Called for reaction at stopping attack at no attackers or targets
     void EnterEvadeMode() override
     {
-        if (!sEluna->EnterEvadeMode(me))
+        // Also calls CREATURE_EVENT_ON_RESET handlers
+        if (!(HasEvent(Hooks::CREATURE_EVENT_ON_LEAVE_COMBAT) || HasEvent(Hooks::CREATURE_EVENT_ON_RESET)) || !E->EnterEvadeMode(me))
             ScriptedAI::EnterEvadeMode();
     }
 
     // Called when the creature is target of hostile action: swing, hostile spell landed, fear/etc)
     void AttackedBy(Unit* attacker) override
     {
-        if (!sEluna->AttackedBy(me, attacker))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_ATTACKED_AT) || !E->AttackedBy(me, attacker))
             ScriptedAI::AttackedBy(attacker);
     }
 
     // Called when creature is spawned or respawned (for reseting variables)
     void JustRespawned() override
     {
-        if (!sEluna->JustRespawned(me))
+        // Also calls CREATURE_EVENT_ON_RESET handlers
+        if (!(HasEvent(Hooks::CREATURE_EVENT_ON_SPAWN) || HasEvent(Hooks::CREATURE_EVENT_ON_RESET)) || !E->JustRespawned(me))
             ScriptedAI::JustRespawned();
     }
 
     // Called at reaching home after evade
     void JustReachedHome() override
     {
-        if (!sEluna->JustReachedHome(me))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_REACH_HOME) || !E->JustReachedHome(me))
             ScriptedAI::JustReachedHome();
     }
 
     // Called at text emote receive from player
     void ReceiveEmote(Player* player, uint32 emoteId) override
     {
-        if (!sEluna->ReceiveEmote(me, player, emoteId))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_RECEIVE_EMOTE) || !E->ReceiveEmote(me, player, emoteId))
             ScriptedAI::ReceiveEmote(player, emoteId);
     }
 
     // called when the corpse of this creature gets removed
     void CorpseRemoved(uint32& respawnDelay) override
     {
-        if (!sEluna->CorpseRemoved(me, respawnDelay))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_CORPSE_REMOVED) || !E->CorpseRemoved(me, respawnDelay))
             ScriptedAI::CorpseRemoved(respawnDelay);
     }
 
@@ -156,21 +191,21 @@ struct ElunaCreatureAI : ScriptedAI
 
     void MoveInLineOfSight(Unit* who) override
     {
-        if (!sEluna->MoveInLineOfSight(me, who))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_MOVE_IN_LOS) || !E->MoveInLineOfSight(me, who))
             ScriptedAI::MoveInLineOfSight(who);
     }
 
     // Called when hit by a spell
     void SpellHit(Unit* caster, SpellInfo const* spell) override
     {
-        if (!sEluna->SpellHit(me, caster, spell))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_HIT_BY_SPELL) || !E->SpellHit(me, caster, spell))
             ScriptedAI::SpellHit(caster, spell);
     }
 
     // Called when spell hits a target
     void SpellHitTarget(Unit* target, SpellInfo const* spell) override
     {
-        if (!sEluna->SpellHitTarget(me, target, spell))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_SPELL_HIT_TARGET) || !E->SpellHitTarget(me, target, spell))
             ScriptedAI::SpellHitTarget(target, spell);
     }
 
@@ -179,27 +214,27 @@ struct ElunaCreatureAI : ScriptedAI
     // Called when the creature is summoned successfully by other creature
     void IsSummonedBy(Unit* summoner) override
     {
-        if (!sEluna->OnSummoned(me, summoner))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_SUMMONED) || !E->OnSummoned(me, summoner))
             ScriptedAI::IsSummonedBy(summoner);
     }
 
     void SummonedCreatureDies(Creature* summon, Unit* killer) override
     {
-        if (!sEluna->SummonedCreatureDies(me, summon, killer))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_SUMMONED_CREATURE_DIED) || !E->SummonedCreatureDies(me, summon, killer))
             ScriptedAI::SummonedCreatureDies(summon, killer);
     }
 
     // Called when owner takes damage
     void OwnerAttackedBy(Unit* attacker) override
     {
-        if (!sEluna->OwnerAttackedBy(me, attacker))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_OWNER_ATTACKED_AT) || !E->OwnerAttackedBy(me, attacker))
             ScriptedAI::OwnerAttackedBy(attacker);
     }
 
     // Called when owner attacks something
     void OwnerAttacked(Unit* target) override
     {
-        if (!sEluna->OwnerAttacked(me, target))
+        if (!HasEvent(Hooks::CREATURE_EVENT_ON_OWNER_ATTACKED) || !E->OwnerAttacked(me, target))
             ScriptedAI::OwnerAttacked(target);
     }
 #endif
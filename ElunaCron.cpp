@@ -0,0 +1,227 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaCron.h"
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+// Years searched for the next match. February 29th can be 8 years apart, around 2100
+static const int CRON_MAX_YEARS = 8;
+
+static void LocalTime(time_t time, tm& out)
+{
+#ifdef WIN32
+    localtime_s(&out, &time);
+#else
+    localtime_r(&time, &out);
+#endif
+}
+
+// Normalizes the fields after one was advanced
+static time_t Normalize(tm& date)
+{
+    date.tm_isdst = -1;
+    time_t time = mktime(&date);
+    LocalTime(time, date);
+    return time;
+}
+
+static bool ParseNumber(const std::string& text, uint32& value)
+{
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos || text.size() > 2)
+        return false;
+    value = uint32(atoi(text.c_str()));
+    return true;
+}
+
+// Parses a comma separated field into bits of the allowed values
+static bool ParseField(const std::string& field, uint32 low, uint32 high, uint64& bits)
+{
+    bits = 0;
+    // getline skips a trailing empty item
+    if (field.empty() || field[field.size() - 1] == ',')
+        return false;
+
+    std::stringstream items(field);
+    std::string item;
+    while (std::getline(items, item, ','))
+    {
+        uint32 step = 1;
+        std::string::size_type slash = item.find('/');
+        if (slash != std::string::npos)
+        {
+            if (!ParseNumber(item.substr(slash + 1), step) || !step)
+                return false;
+            item.erase(slash);
+        }
+
+        uint32 first = low;
+        uint32 last = high;
+        if (item != "*")
+        {
+            std::string::size_type dash = item.find('-');
+            if (dash == std::string::npos)
+            {
+                if (!ParseNumber(item, first))
+                    return false;
+                // A single value with a step runs to the end like cron
+                last = slash != std::string::npos ? high : first;
+            }
+            else if (!ParseNumber(item.substr(0, dash), first) || !ParseNumber(item.substr(dash + 1), last))
+                return false;
+        }
+
+        if (first < low || last > high || first > last)
+            return false;
+
+        for (uint32 value = first; value <= last; value += step)
+            bits |= uint64(1) << value;
+    }
+    return bits != 0;
+}
+
+ElunaCronSpec::ElunaCronSpec() : minutes(0), hours(0), days(0), months(0), weekdays(0), anyDay(true), anyWeekday(true)
+{
+}
+
+bool ElunaCronSpec::Parse(const std::string& spec)
+{
+    std::stringstream stream(spec);
+    std::string fields[5];
+    for (uint32 i = 0; i < 5; ++i)
+        if (!(stream >> fields[i]))
+            return false;
+
+    std::string extra;
+    if (stream >> extra)
+        return false;
+
+    uint64 bits[5];
+    if (!ParseField(fields[0], 0, 59, bits[0]) ||
+        !ParseField(fields[1], 0, 23, bits[1]) ||
+        !ParseField(fields[2], 1, 31, bits[2]) ||
+        !ParseField(fields[3], 1, 12, bits[3]) ||
+        !ParseField(fields[4], 0, 7, bits[4]))
+        return false;
+
+    // With only the day of month restricted, some listed day must exist in some listed month, February 29th included
+    if (fields[2][0] != '*' && fields[4][0] == '*')
+    {
+        static const uint32 monthDays[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+        bool possible = false;
+        for (uint32 month = 1; month <= 12 && !possible; ++month)
+            if ((bits[3] >> month) & 1)
+                possible = (bits[2] & ((uint64(2) << monthDays[month - 1]) - 1)) != 0;
+        if (!possible)
+            return false;
+    }
+
+    minutes = bits[0];
+    hours = uint32(bits[1]);
+    days = uint32(bits[2]);
+    months = uint32(bits[3]);
+    // Sunday is both 0 and 7
+    weekdays = uint32(bits[4] | (bits[4] >> 7)) & 0x7F;
+    anyDay = fields[2][0] == '*';
+    anyWeekday = fields[4][0] == '*';
+    return true;
+}
+
+bool ElunaCronSpec::DayMatches(const tm& date) const
+{
+    bool day = (days >> date.tm_mday) & 1;
+    bool weekday = (weekdays >> date.tm_wday) & 1;
+    if (anyDay || anyWeekday)
+        return day && weekday;
+    return day || weekday;
+}
+
+time_t ElunaCronSpec::Next(time_t after) const
+{
+    tm date;
+    LocalTime(after, date);
+    date.tm_sec = 0;
+    ++date.tm_min;
+    time_t time = Normalize(date);
+
+    // Advance the largest field that does not match, resetting the fields below it
+    int lastYear = date.tm_year + CRON_MAX_YEARS;
+    while (date.tm_year <= lastYear)
+    {
+        if (!((months >> (date.tm_mon + 1)) & 1))
+        {
+            ++date.tm_mon;
+            date.tm_mday = 1;
+            date.tm_hour = 0;
+            date.tm_min = 0;
+        }
+        else if (!DayMatches(date))
+        {
+            ++date.tm_mday;
+            date.tm_hour = 0;
+            date.tm_min = 0;
+        }
+        else if (!((hours >> date.tm_hour) & 1))
+        {
+            ++date.tm_hour;
+            date.tm_min = 0;
+        }
+        else if (!((minutes >> date.tm_min) & 1))
+            ++date.tm_min;
+        else
+            return time;
+
+        time = Normalize(date);
+    }
+    return 0;
+}
+
+void ElunaCronScheduler::AddEvent(int funcRef, const ElunaCronSpec& spec, time_t next)
+{
+    CronEvent cronEvent;
+    cronEvent.next = next;
+    cronEvent.funcRef = funcRef;
+    cronEvent.spec = spec;
+    events.push_back(cronEvent);
+    std::push_heap(events.begin(), events.end(), &Later);
+    UpdateNextDue();
+}
+
+bool ElunaCronScheduler::RemoveEvent(int eventId)
+{
+    for (std::vector<CronEvent>::iterator it = events.begin(); it != events.end(); ++it)
+    {
+        if (it->funcRef != eventId)
+            continue;
+
+        events.erase(it);
+        std::make_heap(events.begin(), events.end(), &Later);
+        UpdateNextDue();
+        return true;
+    }
+    return false;
+}
+
+bool ElunaCronScheduler::PopDue(time_t now, int& funcRef, bool& expired)
+{
+    if (!IsDue(now))
+        return false;
+
+    std::pop_heap(events.begin(), events.end(), &Later);
+    CronEvent& cronEvent = events.back();
+    funcRef = cronEvent.funcRef;
+
+    // Missed deadlines are called once, the next one is counted from now
+    cronEvent.next = cronEvent.spec.Next(now);
+    expired = !cronEvent.next;
+    if (expired)
+        events.pop_back();
+    else
+        std::push_heap(events.begin(), events.end(), &Later);
+    UpdateNextDue();
+    return true;
+}
@@ -0,0 +1,89 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_CRON_H
+#define _ELUNA_CRON_H
+
+#include <atomic>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#ifdef TRINITY
+#include "Define.h"
+#else
+#include "Platform/Define.h"
+#endif
+
+/*
+ * A cron schedule in the five field format "minute hour day-of-month month day-of-week".
+ *
+ * Fields take *, values, ranges and steps separated by commas, for example "0 4 * * *" or "0-59/15 8-20 * * 1-5".
+ * Sunday is 0 or 7. Like cron, when both day fields are restricted either one matching is enough.
+ * Times are in the server's local time. Nothing here depends on the cores or lua, see tests/CronTest.cpp.
+ */
+class ElunaCronSpec
+{
+public:
+    ElunaCronSpec();
+
+    // Returns false if the spec is not valid or can never match, like "0 0 31 2 *"
+    bool Parse(const std::string& spec);
+    // Returns the first matching minute after the time or 0 if none is found within 8 years
+    time_t Next(time_t after) const;
+
+private:
+    bool DayMatches(const tm& date) const;
+
+    uint64 minutes;
+    uint32 hours;
+    uint32 days;
+    uint32 months;
+    uint32 weekdays;
+    bool anyDay;
+    bool anyWeekday;
+};
+
+/*
+ * Cron events of a lua state kept in a min-heap on their next time,
+ * so checking them on update only looks at the earliest one.
+ */
+class ElunaCronScheduler
+{
+public:
+    ElunaCronScheduler() : nextDue(0) { }
+
+    void AddEvent(int funcRef, const ElunaCronSpec& spec, time_t next);
+    // Returns false if the event was not found. The caller frees the function reference
+    bool RemoveEvent(int eventId);
+    void Clear() { events.clear(); UpdateNextDue(); }
+    bool IsDue(time_t now) const { return !events.empty() && events.front().next <= now; }
+    // Same as IsDue but safe to call without the state lock, so updates only lock when an event is due
+    bool MayBeDue(time_t now) const
+    {
+        time_t next = nextDue.load(std::memory_order_relaxed);
+        return next && next <= now;
+    }
+    // Reschedules the earliest due event and returns its function reference, false if none is due.
+    // Events that will not match again are removed and expired is set so the caller frees the reference
+    bool PopDue(time_t now, int& funcRef, bool& expired);
+
+private:
+    struct CronEvent
+    {
+        time_t next;
+        int funcRef;    // Lua function reference ID, also used as event ID
+        ElunaCronSpec spec;
+    };
+
+    static bool Later(const CronEvent& left, const CronEvent& right) { return left.next > right.next; }
+    void UpdateNextDue() { nextDue.store(events.empty() ? 0 : events.front().next, std::memory_order_relaxed); }
+
+    std::vector<CronEvent> events;
+    std::atomic<time_t> nextDue;    // Time of the earliest event, 0 for none
+};
+
+#endif
@@ -7,6 +7,8 @@
 #include "ElunaEventMgr.h"
 #include "LuaEngine.h"
 #include "Object.h"
+#include <algorithm>
+#include <chrono>
 
 extern "C"
 {
@@ -14,97 +16,412 @@ extern "C"
 #include "lauxlib.h"
 };
 
-ElunaEventProcessor::ElunaEventProcessor(Eluna** _E, WorldObject* _obj) : m_time(0), obj(_obj), E(_E)
+uint32 ElunaEventProcessor::budgetCount = 0;
+uint32 ElunaEventProcessor::budgetMicroseconds = 0;
+ElunaEventProcessor::Stats ElunaEventProcessor::stats;
+std::atomic<uint64> EventMgr::worldUpdates(0);
+thread_local EventBudget EventMgr::budget;
+
+static uint64 BudgetNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ElunaEventProcessor::EventState::EventState() :
+    freeEvents(NO_EVENT), activeEvents(0), lag(0), registered(false)
+{
+}
+
+// Every WorldObject has a processor, nothing is locked or allocated until the first event is added
+ElunaEventProcessor::ElunaEventProcessor(Eluna** _E, WorldObject* _obj, Map* _map) :
+    state(NULL), m_time(0), obj(_obj), map(_map), E(_E)
 {
-    if (obj)
-    {
-        EventMgr::WriteGuard guard((*E)->eventMgr->GetLock());
-        (*E)->eventMgr->processors.insert(this);
-    }
 }
 
 ElunaEventProcessor::~ElunaEventProcessor()
 {
     RemoveEvents_internal();
 
-    if (obj && Eluna::IsInitialized())
+    if (Eluna::IsInitialized())
+        Unregister();
+
+    delete state;
+}
+
+void ElunaEventProcessor::Register()
+{
+    if (!obj || state->registered)
+        return;
+
+    EventMgr::WriteGuard guard((*E)->eventMgr->GetLock());
+    (*E)->eventMgr->processors.insert(this);
+    state->registered = true;
+}
+
+void ElunaEventProcessor::Unregister()
+{
+    if (!state || !state->registered)
+        return;
+
+    EventMgr::WriteGuard guard((*E)->eventMgr->GetLock());
+    (*E)->eventMgr->processors.erase(this);
+    state->registered = false;
+}
+
+void ElunaEventProcessor::Release()
+{
+    Unregister();
+    m_time += state->lag;
+    delete state;
+    state = NULL;
+}
+
+void ElunaEventProcessor::Update(uint32 diff)
+{
+    if (!state)
+    {
+        m_time += diff;
+        return;
+    }
+
+    if (!state->activeEvents)
     {
-        EventMgr::WriteGuard guard((*E)->eventMgr->GetLock());
-        (*E)->eventMgr->processors.erase(this);
+        // The last events may have been removed after the budget ran out
+        m_time += diff;
+        Release();
+        return;
     }
+
+    // Time left over by the budget is caught up on first
+    uint64 target = m_time + state->lag + diff;
+    state->lag = 0;
+
+    // The budget is shared with the other processors updated in the same world or map update.
+    // Time is measured from a start moved back by the time they already spent
+    EventBudget& budget = EventMgr::GetBudget();
+    uint64 start = budgetMicroseconds ? BudgetNow() - budget.microseconds : 0;
+
+    BudgetCaller caller(*this, budget, start, target);
+    if (!state->wheel.Advance(state->events, m_time, target, caller))
+        state->lag = target - m_time;
+    else if (!state->activeEvents)
+        Release();
+
+    if (budgetMicroseconds)
+        budget.microseconds = BudgetNow() - start;
 }
 
-void ElunaEventProcessor::Update(uint32 diff)
+bool ElunaEventProcessor::BudgetCaller::CanCall(uint32 index)
 {
-    m_time += diff;
-    for (EventList::iterator it = eventList.begin(); it != eventList.end() && it->first <= m_time; it = eventList.begin())
+    // Aborted and paused events are only freed or rescheduled, they are not counted and don't use up the budget
+    std::vector<LuaEvent>& events = processor.state->events;
+    if (events[index].abort || events[index].paused)
+        return true;
+
+    if ((!budgetCount || budget.calls < budgetCount) && (!budgetMicroseconds || BudgetNow() - start < budgetMicroseconds))
+        return true;
+
+    uint64 deferred = 0;
+    for (; index != NO_EVENT; index = events[index].next)
+        if (!events[index].abort && !events[index].paused)
+            ++deferred;
+    stats.deferred += deferred;
+    return false;
+}
+
+void ElunaEventProcessor::BudgetCaller::Call(uint32 index)
+{
+    const LuaEvent& luaEvent = processor.state->events[index];
+    if (!luaEvent.abort && !luaEvent.paused)
     {
-        LuaEvent* luaEvent = it->second;
-        eventList.erase(it);
-        eventMap.erase(luaEvent->funcRef);
+        ++budget.calls;
+        ++stats.executed;
+        stats.lateness += target - luaEvent.due;
+    }
+    processor.Execute(index);
+}
 
-        if (!luaEvent->abort)
-        {
-            bool remove = luaEvent->repeats == 1;
-            if (!remove)
-                AddEvent(luaEvent); // Reschedule before calling incase RemoveEvents used
+void ElunaEventProcessor::Execute(uint32 index)
+{
+    LuaEvent& luaEvent = state->events[index];
+    if (luaEvent.abort)
+    {
+        // Event should be deleted (set to be aborted)
+        FreeEvent(index);
+        return;
+    }
 
-            // Call the timed event
-            (*E)->OnTimedEvent(luaEvent->funcRef, luaEvent->delay, luaEvent->repeats ? luaEvent->repeats-- : luaEvent->repeats, obj);
+    if (luaEvent.paused)
+    {
+        // Keep the timer running without calling or using up repeats
+        luaEvent.due = m_time + (luaEvent.delay ? luaEvent.delay : 1);
+        Schedule(index);
+        return;
+    }
 
-            if (!remove)
-                continue;
-        }
+    bool remove = luaEvent.repeats == 1;
+    uint32 calls = luaEvent.repeats ? luaEvent.repeats-- : luaEvent.repeats;
+    Eluna* owner = luaEvent.E;
+    int funcRef = luaEvent.funcRef;
+    uint32 delay = luaEvent.delay;
+
+    if (!remove)
+    {
+        // Reschedule before calling incase RemoveEvents used
+        luaEvent.due = m_time + (delay ? delay : 1);
+        Schedule(index);
+    }
+
+    // Call the timed event. The events vector may grow in the call, luaEvent can't be used after it
+    owner->OnTimedEvent(funcRef, delay, calls, obj, map);
+
+    // Event should be deleted (executed last time)
+    if (remove)
+        FreeEvent(index);
+}
+
+void ElunaEventProcessor::Schedule(uint32 index)
+{
+    state->wheel.Schedule(state->events, index, m_time);
+}
+
+uint32 ElunaEventProcessor::NewEvent()
+{
+    ++state->activeEvents;
+    if (state->freeEvents == NO_EVENT)
+    {
+        state->events.push_back(LuaEvent());
+        return uint32(state->events.size() - 1);
+    }
+
+    uint32 index = state->freeEvents;
+    state->freeEvents = state->events[index].next;
+    state->events[index] = LuaEvent();
+    return index;
+}
+
+void ElunaEventProcessor::FreeEvent(uint32 index)
+{
+    LuaEvent& luaEvent = state->events[index];
+
+    EventMap::iterator it = state->eventMap.find(EventKey(luaEvent.E, luaEvent.funcRef));
+    if (it != state->eventMap.end() && it->second == index)
+        state->eventMap.erase(it);
+
+    if (luaEvent.E)
+    {
+        luaEvent.E->eventMgr->UnindexEvent(luaEvent.funcRef, luaEvent.tag);
 
-        // Event should be deleted (executed last time or set to be aborted)
-        RemoveEvent(luaEvent);
+        // Free lua function ref
+        if (luaEvent.E->L)
+            luaL_unref(luaEvent.E->L, LUA_REGISTRYINDEX, luaEvent.funcRef);
     }
+
+    luaEvent.E = NULL;
+    luaEvent.abort = true;
+    luaEvent.next = state->freeEvents;
+    state->freeEvents = index;
+    --state->activeEvents;
 }
 
 void ElunaEventProcessor::RemoveEvents()
 {
-    for (EventList::iterator it = eventList.begin(); it != eventList.end(); ++it)
-        it->second->abort = true;
+    if (map)
+        static_cast<ElunaMapEventProcessor*>(this)->Queue(ElunaMapEventProcessor::Operation(ElunaMapEventProcessor::Operation::OP_REMOVE_ALL, NULL, 0));
+    else
+        RemoveEventsNow(NULL);
+}
+
+void ElunaEventProcessor::RemoveEvents(Eluna* owner)
+{
+    if (map)
+        static_cast<ElunaMapEventProcessor*>(this)->Queue(ElunaMapEventProcessor::Operation(ElunaMapEventProcessor::Operation::OP_REMOVE_ALL, owner, 0));
+    else
+        RemoveEventsNow(owner);
+}
+
+void ElunaEventProcessor::RemoveEventsNow(Eluna* owner)
+{
+    if (!state)
+        return;
+
+    for (std::vector<LuaEvent>::iterator it = state->events.begin(); it != state->events.end(); ++it)
+        if (!owner || it->E == owner)
+            it->abort = true;
+}
+
+void ElunaEventProcessor::DetachEvents(Eluna* owner)
+{
+    // Map processors only hold events of the state owning their EventMgr, they are deleted with it
+    if (!state || map)
+        return;
+
+    for (std::vector<LuaEvent>::iterator it = state->events.begin(); it != state->events.end(); ++it)
+    {
+        if (it->E != owner)
+            continue;
+        state->eventMap.erase(EventKey(owner, it->funcRef));
+        it->abort = true;
+        it->E = NULL;
+    }
 }
 
 void ElunaEventProcessor::RemoveEvents_internal()
 {
-    //if (!final)
-    //{
-    //    for (EventList::iterator it = eventList.begin(); it != eventList.end(); ++it)
-    //        it->second->to_Abort = true;
-    //    return;
-    //}
+    if (!state)
+        return;
+
+    for (std::vector<LuaEvent>::const_iterator it = state->events.begin(); it != state->events.end(); ++it)
+    {
+        if (!it->E)
+            continue;
+        it->E->eventMgr->UnindexEvent(it->funcRef, it->tag);
+        if (it->E->L)
+            luaL_unref(it->E->L, LUA_REGISTRYINDEX, it->funcRef);
+    }
+
+    // The state stays allocated and registered, the processor may be in the middle of an update or its EventMgr iterating it
+    state->events.clear();
+    state->eventMap.clear();
+    state->wheel.Clear();
+    state->freeEvents = NO_EVENT;
+    state->activeEvents = 0;
+    state->lag = 0;
+}
+
+void ElunaEventProcessor::ResetStats()
+{
+    stats.executed = 0;
+    stats.deferred = 0;
+    stats.lateness = 0;
+}
+
+void ElunaEventProcessor::RemoveEvent(Eluna* owner, int eventId)
+{
+    if (map)
+        static_cast<ElunaMapEventProcessor*>(this)->Queue(ElunaMapEventProcessor::Operation(ElunaMapEventProcessor::Operation::OP_REMOVE, owner, eventId));
+    else
+        RemoveEventNow(owner, eventId);
+}
+
+void ElunaEventProcessor::RemoveEventNow(Eluna* owner, int eventId)
+{
+    if (!state)
+        return;
+
+    EventMap::const_iterator it = state->eventMap.find(EventKey(owner, eventId));
+    if (it != state->eventMap.end())
+        state->events[it->second].abort = true;
+}
+
+void ElunaEventProcessor::SetEventPaused(Eluna* owner, int eventId, bool paused)
+{
+    if (map)
+        static_cast<ElunaMapEventProcessor*>(this)->Queue(ElunaMapEventProcessor::Operation(paused ? ElunaMapEventProcessor::Operation::OP_PAUSE : ElunaMapEventProcessor::Operation::OP_RESUME, owner, eventId));
+    else
+        SetEventPausedNow(owner, eventId, paused);
+}
 
-    for (EventList::iterator it = eventList.begin(); it != eventList.end(); ++it)
-        RemoveEvent(it->second);
+void ElunaEventProcessor::SetEventPausedNow(Eluna* owner, int eventId, bool paused)
+{
+    if (!state)
+        return;
 
-    eventList.clear();
-    eventMap.clear();
+    EventMap::const_iterator it = state->eventMap.find(EventKey(owner, eventId));
+    if (it != state->eventMap.end())
+        state->events[it->second].paused = paused;
 }
 
-void ElunaEventProcessor::RemoveEvent(int eventId)
+void ElunaEventProcessor::AddEvent(Eluna* owner, int funcRef, uint32 delay, uint32 repeats, uint32 tag)
 {
-    if (eventMap.find(eventId) != eventMap.end())
-        eventMap[eventId]->abort = true;
+    if (!map)
+    {
+        AddEventNow(owner, funcRef, delay, repeats, tag);
+        return;
+    }
+
+    // Indexed right away so removing it by ID or tag before it is added queues the removal after it
+    owner->eventMgr->IndexEvent(funcRef, tag, this);
+
+    ElunaMapEventProcessor::Operation operation(ElunaMapEventProcessor::Operation::OP_ADD, owner, funcRef);
+    operation.delay = delay;
+    operation.repeats = repeats;
+    operation.tag = tag;
+    static_cast<ElunaMapEventProcessor*>(this)->Queue(operation);
+}
+
+void ElunaEventProcessor::AddEventNow(Eluna* owner, int funcRef, uint32 delay, uint32 repeats, uint32 tag)
+{
+    if (!state)
+    {
+        state = new EventState();
+        Register();
+    }
+
+    uint32 index = NewEvent();
+    LuaEvent& luaEvent = state->events[index];
+    luaEvent.E = owner;
+    luaEvent.funcRef = funcRef;
+    luaEvent.delay = delay;
+    luaEvent.repeats = repeats;
+    luaEvent.tag = tag;
+    // Events are called at the earliest on the next millisecond
+    luaEvent.due = m_time + (delay ? delay : 1);
+    state->eventMap[EventKey(owner, funcRef)] = index;
+    Schedule(index);
+
+    owner->eventMgr->IndexEvent(funcRef, tag, this);
 }
 
-void ElunaEventProcessor::AddEvent(LuaEvent* luaEvent)
+ElunaMapEventProcessor::~ElunaMapEventProcessor()
 {
-    eventList.insert(std::pair<uint64, LuaEvent*>(m_time + luaEvent->delay, luaEvent));
-    eventMap[luaEvent->funcRef] = luaEvent;
+    // Events that were never added still hold their function references
+    for (std::vector<Operation>::const_iterator it = pending.begin(); it != pending.end(); ++it)
+    {
+        if (it->type != Operation::OP_ADD)
+            continue;
+        it->owner->eventMgr->UnindexEvent(it->funcRef, it->tag);
+        if (it->owner->L)
+            luaL_unref(it->owner->L, LUA_REGISTRYINDEX, it->funcRef);
+    }
 }
 
-void ElunaEventProcessor::AddEvent(int funcRef, uint32 delay, uint32 repeats)
+void ElunaMapEventProcessor::Queue(const Operation& operation)
 {
-    AddEvent(new LuaEvent(funcRef, delay, repeats));
+    std::lock_guard<std::mutex> guard(pendingLock);
+    pending.push_back(operation);
 }
 
-void ElunaEventProcessor::RemoveEvent(LuaEvent* luaEvent)
+void ElunaMapEventProcessor::Update(uint32 diff)
 {
-    // Free lua function ref
-    luaL_unref((*E)->L, LUA_REGISTRYINDEX, luaEvent->funcRef);
-    delete luaEvent;
+    // Applied unlocked, adding an event locks the event index which the queueing side may hold
+    std::vector<Operation> operations;
+    {
+        std::lock_guard<std::mutex> guard(pendingLock);
+        operations.swap(pending);
+    }
+
+    for (std::vector<Operation>::const_iterator it = operations.begin(); it != operations.end(); ++it)
+    {
+        switch (it->type)
+        {
+            case Operation::OP_ADD:
+                AddEventNow(it->owner, it->funcRef, it->delay, it->repeats, it->tag);
+                break;
+            case Operation::OP_REMOVE:
+                RemoveEventNow(it->owner, it->funcRef);
+                break;
+            case Operation::OP_PAUSE:
+            case Operation::OP_RESUME:
+                SetEventPausedNow(it->owner, it->funcRef, it->type == Operation::OP_PAUSE);
+                break;
+            case Operation::OP_REMOVE_ALL:
+                RemoveEventsNow(it->owner);
+                break;
+        }
+    }
+
+    ElunaEventProcessor::Update(diff);
 }
 
 EventMgr::EventMgr(Eluna** _E) : globalProcessor(new ElunaEventProcessor(_E, NULL)), E(_E)
@@ -120,6 +437,9 @@ EventMgr::~EventMgr()
                 (*it)->RemoveEvents_internal();
         globalProcessor->RemoveEvents_internal();
     }
+    for (MapProcessors::const_iterator it = mapProcessors.begin(); it != mapProcessors.end(); ++it)
+        delete it->second;
+    mapProcessors.clear();
     delete globalProcessor;
     globalProcessor = NULL;
 }
@@ -130,14 +450,170 @@ void EventMgr::RemoveEvents()
     if (!processors.empty())
         for (ProcessorSet::const_iterator it = processors.begin(); it != processors.end(); ++it) // loop processors
             (*it)->RemoveEvents();
+    for (MapProcessors::const_iterator it = mapProcessors.begin(); it != mapProcessors.end(); ++it)
+        it->second->RemoveEvents();
     globalProcessor->RemoveEvents();
 }
 
 void EventMgr::RemoveEvent(int eventId)
+{
+    // Processors unindex their events before they are destroyed, the lock keeps them alive
+    EventIndex::ReadGuard guard(index.GetLock());
+    UNORDERED_MAP<int, ElunaEventProcessor*>::const_iterator it = index.processors.find(eventId);
+    if (it != index.processors.end())
+        it->second->RemoveEvent(*E, eventId);
+}
+
+void EventMgr::RemoveStateEvents()
+{
+    // The index holds every processor with events of this state, whichever state's processor list they are in
+    EventIndex::ReadGuard guard(index.GetLock());
+    for (UNORDERED_MAP<int, ElunaEventProcessor*>::const_iterator it = index.processors.begin(); it != index.processors.end(); ++it)
+        it->second->RemoveEvent(*E, it->first);
+}
+
+void EventMgr::RemoveEventsByTag(const std::string& tag)
+{
+    EventIndex::ReadGuard guard(index.GetLock());
+    UNORDERED_MAP<std::string, uint32>::const_iterator tagIt = index.tagIds.find(tag);
+    if (tagIt == index.tagIds.end())
+        return;
+
+    UNORDERED_MAP<uint32, EventSet>::const_iterator eventsIt = index.tagged.find(tagIt->second);
+    if (eventsIt == index.tagged.end())
+        return;
+
+    for (EventSet::const_iterator it = eventsIt->second.begin(); it != eventsIt->second.end(); ++it)
+    {
+        UNORDERED_MAP<int, ElunaEventProcessor*>::const_iterator processor = index.processors.find(*it);
+        if (processor != index.processors.end())
+            processor->second->RemoveEvent(*E, *it);
+    }
+}
+
+void EventMgr::SetEventsPausedByTag(const std::string& tag, bool paused)
+{
+    EventIndex::ReadGuard guard(index.GetLock());
+    UNORDERED_MAP<std::string, uint32>::const_iterator tagIt = index.tagIds.find(tag);
+    if (tagIt == index.tagIds.end())
+        return;
+
+    UNORDERED_MAP<uint32, EventSet>::const_iterator eventsIt = index.tagged.find(tagIt->second);
+    if (eventsIt == index.tagged.end())
+        return;
+
+    for (EventSet::const_iterator it = eventsIt->second.begin(); it != eventsIt->second.end(); ++it)
+    {
+        UNORDERED_MAP<int, ElunaEventProcessor*>::const_iterator processor = index.processors.find(*it);
+        if (processor != index.processors.end())
+            processor->second->SetEventPaused(*E, *it, paused);
+    }
+}
+
+uint32 EventMgr::GetTagId(const std::string& tag)
+{
+    // Tag IDs are never released, scripts use a handful of tags
+    EventIndex::WriteGuard guard(index.GetLock());
+    UNORDERED_MAP<std::string, uint32>::const_iterator it = index.tagIds.find(tag);
+    if (it != index.tagIds.end())
+        return it->second;
+
+    uint32 tagId = uint32(index.tagIds.size() + 1);
+    index.tagIds[tag] = tagId;
+    return tagId;
+}
+
+void EventMgr::IndexEvent(int eventId, uint32 tagId, ElunaEventProcessor* processor)
+{
+    EventIndex::WriteGuard guard(index.GetLock());
+    index.processors[eventId] = processor;
+    if (tagId)
+        index.tagged[tagId].insert(eventId);
+}
+
+void EventMgr::UnindexEvent(int eventId, uint32 tagId)
+{
+    EventIndex::WriteGuard guard(index.GetLock());
+    index.processors.erase(eventId);
+    if (!tagId)
+        return;
+
+    UNORDERED_MAP<uint32, EventSet>::iterator it = index.tagged.find(tagId);
+    if (it == index.tagged.end())
+        return;
+    it->second.erase(eventId);
+    if (it->second.empty())
+        index.tagged.erase(it);
+}
+
+void EventMgr::StartBudget(bool worldUpdate)
+{
+    uint64 update = worldUpdate ? ++worldUpdates : worldUpdates.load(std::memory_order_relaxed);
+    budget = EventBudget();
+    budget.update = update;
+}
+
+EventBudget& EventMgr::GetBudget()
+{
+    // Threads that update objects outside of a world or map update start the budget again on every world update
+    uint64 update = worldUpdates.load(std::memory_order_relaxed);
+    if (budget.update != update)
+    {
+        budget = EventBudget();
+        budget.update = update;
+    }
+    return budget;
+}
+
+void EventMgr::DetachEvents(Eluna* owner)
 {
     ReadGuard guard(GetLock());
     if (!processors.empty())
         for (ProcessorSet::const_iterator it = processors.begin(); it != processors.end(); ++it) // loop processors
-            (*it)->RemoveEvent(eventId);
-    globalProcessor->RemoveEvent(eventId);
+            (*it)->DetachEvents(owner);
+    for (MapProcessors::const_iterator it = mapProcessors.begin(); it != mapProcessors.end(); ++it)
+        it->second->DetachEvents(owner);
+    globalProcessor->DetachEvents(owner);
+}
+
+ElunaMapEventProcessor* EventMgr::GetMapProcessor(Map* map, bool create)
+{
+    {
+        ReadGuard guard(GetLock());
+        MapProcessors::const_iterator it = mapProcessors.find(map);
+        if (it != mapProcessors.end())
+            return it->second;
+    }
+
+    if (!create)
+        return NULL;
+
+    WriteGuard guard(GetLock());
+    ElunaMapEventProcessor*& processor = mapProcessors[map];
+    if (!processor)
+        processor = new ElunaMapEventProcessor(E, map);
+    return processor;
+}
+
+void EventMgr::UpdateMapEvents(Map* map, uint32 diff)
+{
+    // Only the map's update and destruction use the processor directly, other threads queue their calls to it.
+    // It is updated unlocked so the events can create processors
+    ElunaMapEventProcessor* processor = GetMapProcessor(map, false);
+    if (processor)
+        processor->Update(diff);
+}
+
+void EventMgr::RemoveMapEvents(Map* map)
+{
+    ElunaMapEventProcessor* processor = NULL;
+    {
+        WriteGuard guard(GetLock());
+        MapProcessors::iterator it = mapProcessors.find(map);
+        if (it == mapProcessors.end())
+            return;
+        processor = it->second;
+        mapProcessors.erase(it);
+    }
+    delete processor;
 }
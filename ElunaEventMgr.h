@@ -8,8 +8,12 @@
 #define _ELUNA_EVENT_MGR_H
 
 #include "ElunaUtility.h"
+#include "ElunaTimingWheel.h"
 #include "Common.h"
-#include <map>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 #ifdef TRINITY
 #include "Define.h"
@@ -21,55 +25,208 @@ class Eluna;
 class EventMgr;
 class ElunaEventProcessor;
 class WorldObject;
+class Map;
 
 struct LuaEvent
 {
-    LuaEvent(int _funcRef, uint32 _delay, uint32 _repeats) :
-        delay(_delay), repeats(_repeats), funcRef(_funcRef), abort(false)
+    LuaEvent() :
+        E(NULL), due(0), delay(0), repeats(0), funcRef(0), tag(0), abort(false), paused(false), next(0)
     {
     }
+    Eluna* E;       // State owning the function reference, NULL if the state was destroyed or the event is free
+    uint64 due;     // Processor time the event is called at
     uint32 delay;   // Delay between event calls
     uint32 repeats; // Amount of repeats to make, 0 for infinite
     int funcRef;    // Lua function reference ID, also used as event ID
+    uint32 tag;     // Tag ID from the owner's EventMgr, 0 for none
     bool abort;     // True if aborted and should not execute anymore
+    bool paused;    // True if the calls are skipped until resumed
+    uint32 next;    // Index of the next event in the same wheel slot or free list
+};
+
+// Timed event calls made and time spent on them in the update running on a thread, see EventMgr::GetBudget
+struct EventBudget
+{
+    EventBudget() : update(0), calls(0), microseconds(0) { }
+    uint64 update;          // World update the budget belongs to
+    uint32 calls;
+    uint64 microseconds;
 };
 
 class ElunaEventProcessor
 {
     friend class EventMgr;
+    friend class ElunaMapEventProcessor;
 
 public:
-    typedef std::multimap<uint64, LuaEvent*> EventList;
-    typedef UNORDERED_MAP<int, LuaEvent*> EventMap;
+    // Event IDs are function references, which are only unique within the state that made them
+    typedef std::pair<Eluna*, int> EventKey; // owner, event ID
+    struct EventKeyHash
+    {
+        size_t operator()(const EventKey& key) const { return std::hash<Eluna*>()(key.first) ^ std::hash<int>()(key.second); }
+    };
+    typedef UNORDERED_MAP<EventKey, uint32, EventKeyHash> EventMap; // index of the event
+
+    // Counters of all processors, see GetEventStats
+    struct Stats
+    {
+        std::atomic<uint64> executed;   // Event calls
+        std::atomic<uint64> deferred;   // Due events carried over to the next update by the budget
+        std::atomic<uint64> lateness;   // Total milliseconds the calls were made after their due time
+    };
 
-    ElunaEventProcessor(Eluna** _E, WorldObject* _obj);
+    ElunaEventProcessor(Eluna** _E, WorldObject* _obj, Map* _map = NULL);
     ~ElunaEventProcessor();
 
     void Update(uint32 diff);
+
+    // The calls below are queued on map processors, see ElunaMapEventProcessor
     // removes all timed events on next tick or at tick end
     void RemoveEvents();
-    // set the event to be removed when executing
-    void RemoveEvent(int eventId);
-    void AddEvent(int funcRef, uint32 delay, uint32 repeats);
-    EventMap eventMap;
+    // removes the timed events owned by the state on next tick or at tick end
+    void RemoveEvents(Eluna* owner);
+    // set the event of the owner to be removed when executing
+    void RemoveEvent(Eluna* owner, int eventId);
+    // pause or resume the event of the owner, a paused event is rescheduled without calling it
+    void SetEventPaused(Eluna* owner, int eventId, bool paused);
+    void AddEvent(Eluna* owner, int funcRef, uint32 delay, uint32 repeats, uint32 tag = 0);
+
+    // Limits the calls made in each world or map update by all the processors updated in it, 0 for no limit.
+    // Due events left over are called first on the processor's next update
+    static void SetBudget(uint32 count, uint32 microseconds) { budgetCount = count; budgetMicroseconds = microseconds; }
+    static const Stats& GetStats() { return stats; }
+    static void ResetStats();
 
 private:
+    // Events are pooled in the events vector and kept in a timing wheel by index
+    typedef ElunaTimingWheel<LuaEvent> Wheel;
+    static const uint32 NO_EVENT = Wheel::NO_EVENT;
+
+    static uint32 budgetCount;
+    static uint32 budgetMicroseconds;
+    static Stats stats;
+
+    // Everything a processor needs while it has events. Allocated on the first AddEvent and freed by Release,
+    // so a processor of an object without events only holds its clock and owner pointers
+    struct EventState
+    {
+        EventState();
+
+        std::vector<LuaEvent> events;
+        EventMap eventMap;
+        Wheel wheel;
+        uint32 freeEvents;
+        uint32 activeEvents;
+        uint64 lag;         // Time the last update did not get to because the budget ran out
+        bool registered;    // In EventMgr::processors
+    };
+
+    // The calls made directly on the processor
+    void AddEventNow(Eluna* owner, int funcRef, uint32 delay, uint32 repeats, uint32 tag);
+    void RemoveEventNow(Eluna* owner, int eventId);
+    void SetEventPausedNow(Eluna* owner, int eventId, bool paused);
+    // Removes the events of the owner, all events if owner is NULL
+    void RemoveEventsNow(Eluna* owner);
+
     void RemoveEvents_internal();
-    void AddEvent(LuaEvent* luaEvent);
-    void RemoveEvent(LuaEvent* luaEvent);
-    EventList eventList;
+    // Drops the events of the owner without freeing their function references, see EventMgr::DetachEvents
+    void DetachEvents(Eluna* owner);
+    // Object processors are in EventMgr::processors only while they have events
+    void Register();
+    void Unregister();
+    // Frees the event state once all events are done
+    void Release();
+    uint32 NewEvent();
+    void FreeEvent(uint32 index);
+    void Schedule(uint32 index);
+    void Execute(uint32 index);
+
+    // Calls the due events of the processor while the budget lasts, see ElunaTimingWheel::Advance
+    struct BudgetCaller
+    {
+        BudgetCaller(ElunaEventProcessor& _processor, EventBudget& _budget, uint64 _start, uint64 _target) :
+            processor(_processor), budget(_budget), start(_start), target(_target) { }
+
+        bool CanCall(uint32 index);
+        void Call(uint32 index);
+
+        ElunaEventProcessor& processor;
+        EventBudget& budget;
+        uint64 start;   // Microseconds the budget's time is measured from
+        uint64 target;  // Time the update advances to, used for the lateness of the calls
+    };
+
+    EventState* state;  // NULL while there are no events
     uint64 m_time;
     WorldObject* obj;
+    Map* map;
     Eluna** E;
 };
 
+/*
+ * Timed events of a map. The map's thread updates them, while any thread holding a lua state lock can add or remove them,
+ * for example the world thread on GetMapById(id):RegisterEvent(...). Locking the processor for its update would deadlock
+ * against a state lock taken by the events, so additions and removals are queued and applied at the start of the map's update.
+ */
+class ElunaMapEventProcessor : public ElunaEventProcessor
+{
+    friend class ElunaEventProcessor;
+
+public:
+    ElunaMapEventProcessor(Eluna** _E, Map* _map) : ElunaEventProcessor(_E, NULL, _map) { }
+    ~ElunaMapEventProcessor();
+
+    // Applies the queued calls and updates the events, call from the map's update
+    void Update(uint32 diff);
+
+private:
+    struct Operation
+    {
+        enum Type
+        {
+            OP_ADD,
+            OP_REMOVE,
+            OP_PAUSE,
+            OP_RESUME,
+            OP_REMOVE_ALL
+        };
+
+        Operation(Type _type, Eluna* _owner, int _funcRef) : type(_type), owner(_owner), funcRef(_funcRef), delay(0), repeats(0), tag(0) { }
+
+        Type type;
+        Eluna* owner;   // NULL with OP_REMOVE_ALL to remove the events of all states
+        int funcRef;
+        uint32 delay;
+        uint32 repeats;
+        uint32 tag;
+    };
+
+    void Queue(const Operation& operation);
+
+    std::mutex pendingLock;
+    std::vector<Operation> pending;
+};
+
 class EventMgr : public ElunaUtil::RWLockable
 {
 public:
     typedef UNORDERED_SET<ElunaEventProcessor*> ProcessorSet;
+    typedef UNORDERED_SET<int> EventSet;
+    typedef UNORDERED_MAP<Map*, ElunaMapEventProcessor*> MapProcessors;
+
+    // Processors and tags of the events registered from this state, with a lock of its own
+    struct EventIndex : public ElunaUtil::RWLockable
+    {
+        UNORDERED_MAP<int, ElunaEventProcessor*> processors;    // event ID, processor
+        UNORDERED_MAP<std::string, uint32> tagIds;              // tag, tag ID
+        UNORDERED_MAP<uint32, EventSet> tagged;                 // tag ID, event IDs
+    };
+
     ProcessorSet processors;
+    MapProcessors mapProcessors; // Created on the first Map:RegisterEvent, updated on the map's update
     ElunaEventProcessor* globalProcessor;
     Eluna** E;
+    EventIndex index;
 
     EventMgr(Eluna** _E);
     ~EventMgr();
@@ -78,9 +235,44 @@ public:
     // Execute only in safe env
     void RemoveEvents();
 
+    // Remove all timed events registered from this state, leaving the events of other states on the same objects
+    // Execute only in safe env
+    void RemoveStateEvents();
+
     // Removes the eventId from all events
     // Execute only in safe env
     void RemoveEvent(int eventId);
+
+    // Removes or pauses all events registered with the tag
+    // Execute only in safe env
+    void RemoveEventsByTag(const std::string& tag);
+    void SetEventsPausedByTag(const std::string& tag, bool paused);
+
+    // Returns the ID of the tag, creating one if needed
+    uint32 GetTagId(const std::string& tag);
+    void IndexEvent(int eventId, uint32 tagId, ElunaEventProcessor* processor);
+    void UnindexEvent(int eventId, uint32 tagId);
+
+    // Returns the timed event processor of the map, NULL if it has none and create is false
+    ElunaMapEventProcessor* GetMapProcessor(Map* map, bool create);
+    // Updates the map's timed events, call from the map's update
+    void UpdateMapEvents(Map* map, uint32 diff);
+    // Deletes the map's timed events, call when the map is destroyed
+    void RemoveMapEvents(Map* map);
+
+    // Removes all timed events owned by the state without freeing their function references
+    // Use when the state is destroyed. Execute only in safe env
+    void DetachEvents(Eluna* owner);
+
+    // Starts a new event budget for the update running on the calling thread, call at the start of world and map updates.
+    // Every processor updated on the thread until the next start spends the same budget.
+    static void StartBudget(bool worldUpdate);
+    // Returns the event budget of the calling thread, a budget left from an earlier world update is started over
+    static EventBudget& GetBudget();
+
+private:
+    static std::atomic<uint64> worldUpdates;
+    static thread_local EventBudget budget;
 };
 
 #endif
@@ -0,0 +1,228 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaSharedData.h"
+#include "LuaEngine.h"
+#include "ElunaTemplate.h"
+#include <cstring>
+#include <functional>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+// Serialized value tags
+enum SharedDataTag
+{
+    TAG_FALSE   = 'f',
+    TAG_TRUE    = 't',
+    TAG_NUMBER  = 'n',
+    TAG_STRING  = 's',
+    TAG_INT64   = 'i',
+    TAG_UINT64  = 'u',
+    TAG_TABLE   = 'T',
+    TAG_END     = 'e'
+};
+
+// Maximum nesting of stored tables, also stops reference cycles
+static const int MAX_TABLE_DEPTH = 8;
+
+template<typename T>
+static void Write(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static T Read(const char*& data)
+{
+    T value;
+    memcpy(&value, data, sizeof(T));
+    data += sizeof(T);
+    return value;
+}
+
+static bool SerializeValue(lua_State* L, int index, std::string& out, int depth)
+{
+    switch (lua_type(L, index))
+    {
+        case LUA_TBOOLEAN:
+            out += char(lua_toboolean(L, index) ? TAG_TRUE : TAG_FALSE);
+            return true;
+        case LUA_TNUMBER:
+            out += char(TAG_NUMBER);
+            Write<double>(out, lua_tonumber(L, index));
+            return true;
+        case LUA_TSTRING:
+        {
+            size_t len;
+            const char* str = lua_tolstring(L, index, &len);
+            out += char(TAG_STRING);
+            Write<uint32>(out, uint32(len));
+            out.append(str, len);
+            return true;
+        }
+        case LUA_TUSERDATA:
+            if (long long* value = Eluna::CHECKOBJ<long long>(L, index, false))
+            {
+                out += char(TAG_INT64);
+                Write<long long>(out, *value);
+                return true;
+            }
+            if (unsigned long long* value = Eluna::CHECKOBJ<unsigned long long>(L, index, false))
+            {
+                out += char(TAG_UINT64);
+                Write<unsigned long long>(out, *value);
+                return true;
+            }
+            return false;
+        case LUA_TTABLE:
+        {
+            if (depth >= MAX_TABLE_DEPTH)
+                return false;
+
+            if (index < 0)
+                index = lua_gettop(L) + index + 1;
+
+            out += char(TAG_TABLE);
+            lua_pushnil(L);
+            while (lua_next(L, index))
+            {
+                // Table keys are not supported
+                if (lua_type(L, -2) == LUA_TTABLE || !SerializeValue(L, -2, out, depth + 1) || !SerializeValue(L, -1, out, depth + 1))
+                {
+                    lua_pop(L, 2);
+                    return false;
+                }
+                lua_pop(L, 1);
+            }
+            out += char(TAG_END);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void DeserializeValue(lua_State* L, const char*& data, bool eluna)
+{
+    switch (*data++)
+    {
+        case TAG_FALSE:
+            Eluna::Push(L, false);
+            break;
+        case TAG_TRUE:
+            Eluna::Push(L, true);
+            break;
+        case TAG_NUMBER:
+            Eluna::Push(L, Read<double>(data));
+            break;
+        case TAG_STRING:
+        {
+            uint32 len = Read<uint32>(data);
+            lua_pushlstring(L, data, len);
+            data += len;
+            break;
+        }
+        case TAG_INT64:
+            if (eluna)
+                Eluna::Push(L, Read<long long>(data));
+            else
+                Eluna::Push(L, double(Read<long long>(data)));
+            break;
+        case TAG_UINT64:
+            if (eluna)
+                Eluna::Push(L, Read<unsigned long long>(data));
+            else
+                Eluna::Push(L, double(Read<unsigned long long>(data)));
+            break;
+        case TAG_TABLE:
+            lua_newtable(L);
+            while (*data != TAG_END)
+            {
+                DeserializeValue(L, data, eluna); // key
+                DeserializeValue(L, data, eluna); // value
+                lua_rawset(L, -3);
+            }
+            ++data;
+            break;
+        default:
+            // Only data written by Serialize is stored
+            ASSERT(false);
+            break;
+    }
+}
+
+ElunaSharedData& ElunaSharedData::Instance()
+{
+    static ElunaSharedData instance;
+    return instance;
+}
+
+bool ElunaSharedData::Serialize(lua_State* L, int index, std::string& out)
+{
+    out.clear();
+    return SerializeValue(L, index, out, 0);
+}
+
+void ElunaSharedData::Deserialize(lua_State* L, const std::string& data, bool eluna)
+{
+    const char* ptr = data.data();
+    DeserializeValue(L, ptr, eluna);
+}
+
+ElunaSharedData::Shard& ElunaSharedData::GetShard(const std::string& key)
+{
+    return shards[std::hash<std::string>()(key) % SHARD_COUNT];
+}
+
+bool ElunaSharedData::Get(const std::string& key, std::string& value)
+{
+    Shard& shard = GetShard(key);
+    ElunaUtil::RWLockable::ReadGuard guard(shard.GetLock());
+    UNORDERED_MAP<std::string, std::string>::const_iterator it = shard.values.find(key);
+    if (it == shard.values.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+void ElunaSharedData::Set(const std::string& key, const std::string& value)
+{
+    Shard& shard = GetShard(key);
+    ElunaUtil::RWLockable::WriteGuard guard(shard.GetLock());
+    shard.values[key] = value;
+}
+
+void ElunaSharedData::Remove(const std::string& key)
+{
+    Shard& shard = GetShard(key);
+    ElunaUtil::RWLockable::WriteGuard guard(shard.GetLock());
+    shard.values.erase(key);
+}
+
+bool ElunaSharedData::Add(const std::string& key, double amount, double& result)
+{
+    Shard& shard = GetShard(key);
+    ElunaUtil::RWLockable::WriteGuard guard(shard.GetLock());
+    std::string& value = shard.values[key];
+
+    result = amount;
+    if (!value.empty())
+    {
+        if (value[0] != TAG_NUMBER)
+            return false;
+        const char* data = value.data() + 1;
+        result += Read<double>(data);
+    }
+
+    value.clear();
+    value += char(TAG_NUMBER);
+    Write<double>(value, result);
+    return true;
+}
@@ -0,0 +1,54 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_SHARED_DATA_H
+#define _ELUNA_SHARED_DATA_H
+
+#include "ElunaUtility.h"
+#include <string>
+
+struct lua_State;
+
+/*
+ * Key/value store shared by all lua states and threads.
+ *
+ * Values are stored serialized, so they can be read into any lua state.
+ * Accessing a key only locks the shard the key is in, LOCK_ELUNA is never needed.
+ */
+class ElunaSharedData
+{
+public:
+    static ElunaSharedData& Instance();
+
+    // Serializes the value at index to out. Returns false if the value can not be stored
+    static bool Serialize(lua_State* L, int index, std::string& out);
+    // Pushes a value serialized with Serialize.
+    // States without Eluna, like worker states, get 64 bit integers as numbers
+    static void Deserialize(lua_State* L, const std::string& data, bool eluna = true);
+
+    bool Get(const std::string& key, std::string& value);
+    void Set(const std::string& key, const std::string& value);
+    void Remove(const std::string& key);
+    // Adds amount to the number stored in key, a missing value counts as 0.
+    // Returns false if the stored value is not a number
+    bool Add(const std::string& key, double amount, double& result);
+
+private:
+    static const uint32 SHARD_COUNT = 32;
+
+    struct Shard : public ElunaUtil::RWLockable
+    {
+        UNORDERED_MAP<std::string, std::string> values;
+    };
+
+    Shard& GetShard(const std::string& key);
+
+    Shard shards[SHARD_COUNT];
+};
+
+#define sElunaSharedData ElunaSharedData::Instance()
+
+#endif
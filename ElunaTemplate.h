@@ -16,6 +16,7 @@ extern "C"
 #include "LuaEngine.h"
 #include "ElunaUtility.h"
 #include "SharedDefines.h"
+#include <new>
 
 class ElunaGlobal
 {
@@ -63,22 +64,39 @@ public:
     }
 };
 
+// ElunaObject is constructed directly in the memory block of the lua userdata that represents it
+//   and it is destructed by the __gc metamethod. Lua frees the memory.
 class ElunaObject
 {
 public:
-    ElunaObject(void* obj, bool manageMemory) : _isvalid(false), _invalidate(!manageMemory), object(obj)
+    // Tag at the start of every ElunaObject, checked before any other field of a userdata is read
+    static const uint64 MAGIC = 0x456C756E614F626AULL; // "ElunaObj"
+    // Type ids are bits of a uint64 type mask
+    static const uint32 MAX_TYPES = 64;
+
+    ElunaObject(Eluna* _E, void* obj, uint32 typeId, uint64 typeMask, bool manageMemory) : magic(MAGIC), E(_E), callstackid(0), _invalidate(!manageMemory), type_id(typeId), type_mask(typeMask), object(obj)
     {
         SetValid(true);
     }
 
     ~ElunaObject()
     {
+        magic = 0;
     }
 
     // Get wrapped object pointer
     void* GetObj() const { return object; }
+    // Get the Eluna instance the object belongs to
+    Eluna* GetEluna() const { return E; }
+    // Get the type id of the wrapped object, see ElunaTemplate<T>::typeId
+    uint32 GetTypeId() const { return type_id; }
+    // Get the type id bits of the wrapped object's type and all of its registered base types
+    uint64 GetTypeMask() const { return type_mask; }
+    // Returns whether the memory holds an ElunaObject, only the tag is read
+    static bool IsElunaObject(const void* memory) { return *static_cast<const uint64*>(memory) == MAGIC; }
     // Returns whether the object is valid or not
-    bool IsValid() const { return _isvalid; }
+    // Objects that can be invalidated are valid only during the call stack they were last pushed in
+    bool IsValid() const { return callstackid && (!CanInvalidate() || callstackid == E->GetCallstackId()); }
     // Returns whether the object can be invalidated or not
     bool CanInvalidate() const { return _invalidate; }
 
@@ -93,23 +111,44 @@ public:
     void SetValid(bool valid)
     {
         ASSERT(!valid || (valid && object));
-        _isvalid = valid;
+        callstackid = valid ? E->GetCallstackId() : 0;
     }
     // Sets whether the pointer will be invalidated at end of calls
     void SetValidation(bool invalidate)
     {
+        // Keep a currently valid object valid for the rest of this call stack
+        if (IsValid())
+            callstackid = E->GetCallstackId();
         _invalidate = invalidate;
     }
     // Invalidates the pointer if it should be invalidated
     void Invalidate()
     {
         if (CanInvalidate())
-            _isvalid = false;
+            callstackid = 0;
+    }
+
+    // Returns a new type id for a registered type. Type ids are used as bits in type masks
+    // Only called once per type from RegisterTypes, which runs once per process
+    static uint32 GenerateTypeId(const char* name)
+    {
+        static uint32 typeCount = 0;
+        if (typeCount >= MAX_TYPES)
+        {
+            ELUNA_LOG_ERROR("[Eluna]: Can not register type %s, at most %u types can be registered", name, MAX_TYPES);
+            ASSERT(false);
+        }
+        return typeCount++;
     }
 
 private:
-    bool _isvalid;
+    // Must stay the first member, see IsElunaObject
+    uint64 magic;
+    Eluna* E;
+    uint64 callstackid;
     bool _invalidate;
+    uint32 type_id;
+    uint64 type_mask;
     void* object;
 };
 
@@ -126,30 +165,44 @@ class ElunaTemplate
 public:
     static const char* tname;
     static bool manageMemory;
+    // Type id and a mask with the type id bit of this type and all of its base types set.
+    //   These are used to check the type of pushed objects without looking up metatables.
+    static uint32 typeId;
+    static uint64 typeMask;
 
     // name will be used as type name
     // If gc is true, lua will handle the memory management for object pushed
     // gc should be used if pushing for example WorldPacket,
     // that will only be needed on lua side and will not be managed by TC/mangos/<core>
-    static void Register(Eluna* E, const char* name, bool gc = false)
+    // Sets the static type data shared by all states, only called once per process from RegisterTypes
+    static void RegisterType(const char* name, bool gc = false)
     {
-        ASSERT(E);
         ASSERT(name);
+        ASSERT(!tname);
+
+        tname = name;
+        manageMemory = gc;
+        typeId = ElunaObject::GenerateTypeId(name);
+        typeMask = uint64(1) << typeId;
+    }
+
+    // Creates the method table and metatable of the type in the state, the type must be registered with RegisterType
+    static void Register(Eluna* E)
+    {
+        ASSERT(E);
+        ASSERT(tname);
 
         // check that metatable isn't already there
-        luaL_getmetatable(E->L, name);
+        luaL_getmetatable(E->L, tname);
         ASSERT(lua_isnoneornil(E->L, -1));
 
         // check that metatable isn't already there
-        lua_getglobal(E->L, name);
+        lua_getglobal(E->L, tname);
         ASSERT(lua_isnoneornil(E->L, -1));
 
         // pop metatable and methodtable values
         lua_pop(E->L, 2);
 
-        tname = name;
-        manageMemory = gc;
-
         // create methodtable for userdata of this type
         lua_newtable(E->L);
         int methods = lua_gettop(E->L);
@@ -242,6 +295,16 @@ public:
         lua_pop(E->L, 2);
     }
 
+    // Marks the type as derived from Base so that objects of this type pass checks for Base.
+    // Only called from RegisterTypes, Base must be registered first. A CHECKOBJ specialization for Base must cast the wrapped pointer
+    // from the exact type if the pointer needs adjusting, see the specializations for Object, WorldObject and Unit.
+    template<typename Base>
+    static void SetBaseType()
+    {
+        ASSERT(ElunaTemplate<Base>::typeMask);
+        typeMask |= ElunaTemplate<Base>::typeMask;
+    }
+
     template<typename C>
     static void SetMethods(Eluna* E, ElunaRegister<C>* methodTable)
     {
@@ -278,14 +341,21 @@ public:
             return 1;
         }
 
+        Eluna* E = Eluna::GetEluna(L);
+
         //if (!manageMemory)
         //{
-            lua_getglobal(L, ELUNA_OBJECT_STORE);
+            // The object pointer itself is the key, no need to format or intern a string for it
+            lua_rawgeti(L, LUA_REGISTRYINDEX, E->userdata_table);
             ASSERT(lua_istable(L, -1));
-            lua_pushfstring(L, "%p", obj);
-            lua_gettable(L, -2);
-            if (ElunaObject* elunaObj = Eluna::CHECKTYPE(L, -1, tname, false))
+            lua_pushlightuserdata(L, (void*)obj);
+            lua_rawget(L, -2);
+            // The store only holds ElunaObjects, only the exact type needs to be checked
+            ElunaObject* elunaObj = static_cast<ElunaObject*>(lua_touserdata(L, -1));
+            if (elunaObj && elunaObj->GetTypeId() == typeId)
             {
+                ++E->objectStoreHits;
+
                 // set userdata valid
                 elunaObj->SetValid(true);
 
@@ -296,9 +366,10 @@ public:
             lua_remove(L, -1);
             // left userdata_table in stack
         //}
+        ++E->objectStoreMisses;
 
-        // Create new userdata
-        ElunaObject** ptrHold = static_cast<ElunaObject**>(lua_newuserdata(L, sizeof(ElunaObject*)));
+        // Create new userdata and construct the object in it
+        void* ptrHold = lua_newuserdata(L, sizeof(ElunaObject));
         if (!ptrHold)
         {
             ELUNA_LOG_ERROR("%s could not create new userdata", tname);
@@ -306,7 +377,7 @@ public:
             lua_pushnil(L);
             return 1;
         }
-        *ptrHold = new ElunaObject((void*)(obj), manageMemory);
+        new (ptrHold) ElunaObject(E, (void*)(obj), typeId, typeMask, manageMemory);
 
         // Set metatable for it
         luaL_getmetatable(L, tname);
@@ -321,9 +392,9 @@ public:
 
         //if (!manageMemory)
         //{
-            lua_pushfstring(L, "%p", obj);
+            lua_pushlightuserdata(L, (void*)obj);
             lua_pushvalue(L, -2);
-            lua_settable(L, -4);
+            lua_rawset(L, -4);
             lua_remove(L, -2);
         //}
         return 1;
@@ -331,7 +402,16 @@ public:
 
     static T* Check(lua_State* L, int narg, bool error = true)
     {
-        ElunaObject* elunaObj = Eluna::CHECKTYPE(L, narg, tname, error);
+        ElunaObject* elunaObj = CheckObject(L, narg, error);
+        if (!elunaObj)
+            return NULL;
+        return static_cast<T*>(elunaObj->GetObj());
+    }
+
+    // Returns the valid ElunaObject at narg if it is of this type or of a type derived from this type
+    static ElunaObject* CheckObject(lua_State* L, int narg, bool error = true)
+    {
+        ElunaObject* elunaObj = Eluna::CHECKTYPE(L, narg, tname, uint64(1) << typeId, error);
         if (!elunaObj)
             return NULL;
 
@@ -374,7 +454,7 @@ public:
             }
             return NULL;
         }
-        return static_cast<T*>(elunaObj->GetObj());
+        return elunaObj;
     }
 
     static int GetType(lua_State* L)
@@ -420,9 +500,12 @@ public:
     {
         // Get object pointer (and check type, no error)
         ElunaObject* obj = Eluna::CHECKOBJ<ElunaObject>(L, 1, false);
-        if (obj && manageMemory)
+        if (!obj)
+            return 0;
+        if (manageMemory)
             delete static_cast<T*>(obj->GetObj());
-        delete obj;
+        // The memory is owned by lua, only destruct
+        obj->~ElunaObject();
         return 0;
     }
 
@@ -0,0 +1,227 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_TIMING_WHEEL_H
+#define _ELUNA_TIMING_WHEEL_H
+
+#include <algorithm>
+#include <vector>
+
+#ifdef TRINITY
+#include "Define.h"
+#else
+#include "Platform/Define.h"
+#endif
+
+/*
+ * A hierarchical timing wheel for events pooled in a vector, used by ElunaEventProcessor.
+ * Event must have the fields uint64 due and uint32 next.
+ *
+ * Level 0 has a slot per millisecond, each level above covers WHEEL_SIZE slots of the level below.
+ * Events due later than the wheel covers wait in overflow. The slots are lists linked through Event::next
+ * and hold indexes to the events. Nothing here depends on the cores or lua, see tests/TimingWheelTest.cpp.
+ */
+template<typename Event>
+class ElunaTimingWheel
+{
+public:
+    static const uint32 WHEEL_BITS = 5;
+    static const uint32 WHEEL_SIZE = 1 << WHEEL_BITS;
+    static const uint32 WHEEL_MASK = WHEEL_SIZE - 1;
+    static const uint32 WHEEL_LEVELS = 4;
+    static const uint32 NO_EVENT = 0xFFFFFFFF;
+
+    ElunaTimingWheel()
+    {
+        Clear();
+    }
+
+    // Forgets all scheduled and due events
+    void Clear()
+    {
+        std::fill(wheel, wheel + WHEEL_LEVELS * WHEEL_SIZE, NO_EVENT);
+        scheduled = 0;
+        occupied = 0;
+        overflow = NO_EVENT;
+        dueEvents = NO_EVENT;
+    }
+
+    // Returns true if no events are scheduled or due
+    bool IsEmpty() const { return !scheduled && dueEvents == NO_EVENT; }
+
+    // Due events in call order linked through Event::next, NO_EVENT if none
+    uint32 GetDueEvents() const { return dueEvents; }
+
+    // Puts the event in the slot of its due time. now is the time the wheel is at, the event must be due after it
+    void Schedule(std::vector<Event>& events, uint32 index, uint64 now)
+    {
+        // Slots are lists with the latest scheduled event first
+        uint32* head = GetSlot(events[index].due, now);
+        events[index].next = *head;
+        *head = index;
+        ++scheduled;
+    }
+
+    /*
+     * Advances now to target, calling the events as they become due with caller.Call(index).
+     *
+     * caller.CanCall(index) is asked before each call. If it returns false the event and the ones after it stay due
+     *   and false is returned, now is left at the time they became due on and the next Advance calls them first.
+     * Calls may schedule events, including the one called, and grow the events vector.
+     */
+    template<typename Caller>
+    bool Advance(std::vector<Event>& events, uint64& now, uint64 target, Caller& caller)
+    {
+        if (!CallDue(events, caller))
+            return false;
+
+        while (now < target)
+        {
+            if (IsEmpty())
+            {
+                now = target;
+                break;
+            }
+
+            // Skip to the next level 0 slot with events, stopping at every level 0 wrap to cascade the levels above
+            uint64 next = now + 1;
+            uint32 slot = uint32(next & WHEEL_MASK);
+            if (slot)
+            {
+                uint32 pending = occupied >> slot;
+                if (!pending)
+                    next = (next | WHEEL_MASK) + 1;
+                else
+                    for (; !(pending & 1); pending >>= 1)
+                        ++next;
+            }
+
+            if (next > target)
+            {
+                now = target;
+                break;
+            }
+
+            now = next;
+            Tick(events, now);
+
+            if (!CallDue(events, caller))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    template<typename Caller>
+    bool CallDue(std::vector<Event>& events, Caller& caller)
+    {
+        while (dueEvents != NO_EVENT)
+        {
+            uint32 index = dueEvents;
+            if (!caller.CanCall(index))
+                return false;
+
+            dueEvents = events[index].next;
+            caller.Call(index);
+        }
+        return true;
+    }
+
+    // Makes the events of the level 0 slot of now due
+    void Tick(std::vector<Event>& events, uint64 now)
+    {
+        if (!(now & WHEEL_MASK))
+        {
+            // Move the events of the slots reached on the levels above down, up to the highest level that wrapped.
+            // Lower levels go first as their events were scheduled after the ones above for the same due times
+            uint32 level = 1;
+            for (; level < WHEEL_LEVELS; ++level)
+            {
+                uint32 slot = uint32((now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+                Cascade(events, wheel[level * WHEEL_SIZE + slot], now);
+                if (slot)
+                    break;
+            }
+
+            if (level == WHEEL_LEVELS)
+                Cascade(events, overflow, now);
+        }
+
+        uint32 slot = uint32(now & WHEEL_MASK);
+        uint32 index = wheel[slot];
+        wheel[slot] = NO_EVENT;
+        occupied &= ~(1u << slot);
+
+        // Slots are filled from the front, call the events in the order they were scheduled
+        dueEvents = NO_EVENT;
+        while (index != NO_EVENT)
+        {
+            uint32 next = events[index].next;
+            events[index].next = dueEvents;
+            dueEvents = index;
+            index = next;
+            --scheduled;
+        }
+    }
+
+    // Returns the head of the slot an event due at the time goes to, marking level 0 slots occupied
+    uint32* GetSlot(uint64 due, uint64 now)
+    {
+        uint64 delta = due - now;
+        if (delta < WHEEL_SIZE)
+        {
+            uint32 slot = uint32(due & WHEEL_MASK);
+            occupied |= 1u << slot;
+            return &wheel[slot];
+        }
+
+        for (uint32 level = 1; level < WHEEL_LEVELS; ++level)
+            if (delta < (uint64(1) << (WHEEL_BITS * (level + 1))))
+                return &wheel[level * WHEEL_SIZE + ((due >> (WHEEL_BITS * level)) & WHEEL_MASK)];
+
+        return &overflow;
+    }
+
+    // Moves the events of the slot down to the slots of their due times.
+    // They were scheduled before any event due at the same time in the slots they move to, so they are added
+    //   to the ends of the slots to keep such events in the order they were scheduled.
+    void Cascade(std::vector<Event>& events, uint32& head, uint64 now)
+    {
+        // Ends of the slots the events moved to, looked up on the first event moved to each slot
+        uint32* tails[WHEEL_LEVELS * WHEEL_SIZE + 1] = { };
+
+        uint32 index = head;
+        head = NO_EVENT;
+        while (index != NO_EVENT)
+        {
+            uint32 next = events[index].next;
+
+            uint32* slot = GetSlot(events[index].due, now);
+            uint32*& tail = tails[slot == &overflow ? WHEEL_LEVELS * WHEEL_SIZE : uint32(slot - wheel)];
+            if (!tail)
+                for (tail = slot; *tail != NO_EVENT; tail = &events[*tail].next);
+
+            events[index].next = NO_EVENT;
+            *tail = index;
+            tail = &events[index].next;
+            index = next;
+        }
+    }
+
+    uint32 wheel[WHEEL_LEVELS * WHEEL_SIZE]; // Slot heads
+    uint32 scheduled;   // Events in the slots and overflow
+    uint32 occupied;    // Bits of the level 0 slots that have events
+    uint32 overflow;
+    uint32 dueEvents;   // Due events in call order, left over from the last Advance if the caller stopped it
+};
+
+template<typename Event> const uint32 ElunaTimingWheel<Event>::WHEEL_BITS;
+template<typename Event> const uint32 ElunaTimingWheel<Event>::WHEEL_SIZE;
+template<typename Event> const uint32 ElunaTimingWheel<Event>::WHEEL_MASK;
+template<typename Event> const uint32 ElunaTimingWheel<Event>::WHEEL_LEVELS;
+template<typename Event> const uint32 ElunaTimingWheel<Event>::NO_EVENT;
+
+#endif
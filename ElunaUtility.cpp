@@ -8,6 +8,8 @@
 #include "World.h"
 #include "Object.h"
 #include "Unit.h"
+#include <algorithm>
+#include <functional>
 
 uint32 ElunaUtil::GetCurrTime()
 {
@@ -85,3 +87,151 @@ bool ElunaUtil::WorldObjectInRangeCheck::operator()(WorldObject* u)
         i_range = i_obj->GetDistance(u);
     return true;
 }
+
+bool ElunaUtil::LockProfiler::enabled = false;
+ElunaUtil::LockProfiler::Stats ElunaUtil::LockProfiler::stats[ElunaUtil::LockProfiler::LOCK_KIND_COUNT];
+
+// Per site stats in a fixed open addressing table, so recording a release takes no lock.
+// Sites are function name literals compared by pointer, a slot is claimed once and kept over resets.
+// Sites that don't fit are not recorded
+static const uint32 SITE_SLOTS = 512;
+
+struct SiteSlot
+{
+    std::atomic<const char*> site;
+    std::atomic<uint64> count;
+    std::atomic<uint64> waitTotal;
+    std::atomic<uint64> waitMax;
+};
+
+static SiteSlot siteSlots[SITE_SLOTS];
+
+static uint32 GetBucket(uint64 time)
+{
+    uint32 bucket = 0;
+    while (bucket < ElunaUtil::LockProfiler::BUCKET_COUNT - 1 && time >= (uint64(1) << bucket))
+        ++bucket;
+    return bucket;
+}
+
+static void UpdateMax(std::atomic<uint64>& max, uint64 value)
+{
+    uint64 current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        ;
+}
+
+void ElunaUtil::LockProfiler::Record(Kind kind, const char* site, uint64 wait, uint64 hold)
+{
+    Stats& stat = stats[kind];
+    stat.count.fetch_add(1, std::memory_order_relaxed);
+    stat.waitTotal.fetch_add(wait, std::memory_order_relaxed);
+    stat.holdTotal.fetch_add(hold, std::memory_order_relaxed);
+    UpdateMax(stat.waitMax, wait);
+    stat.wait[GetBucket(wait)].fetch_add(1, std::memory_order_relaxed);
+    stat.hold[GetBucket(hold)].fetch_add(1, std::memory_order_relaxed);
+
+    if (!site)
+        return;
+
+    size_t hash = std::hash<const char*>()(site);
+    for (uint32 i = 0; i < SITE_SLOTS; ++i)
+    {
+        SiteSlot& slot = siteSlots[(hash + i) % SITE_SLOTS];
+        const char* current = slot.site.load(std::memory_order_relaxed);
+        if (!current && slot.site.compare_exchange_strong(current, site, std::memory_order_relaxed))
+            current = site;
+        if (current != site)
+            continue;
+
+        slot.count.fetch_add(1, std::memory_order_relaxed);
+        slot.waitTotal.fetch_add(wait, std::memory_order_relaxed);
+        UpdateMax(slot.waitMax, wait);
+        return;
+    }
+}
+
+static bool SiteWaitOrderPred(const ElunaUtil::LockProfiler::SiteStats& left, const ElunaUtil::LockProfiler::SiteStats& right)
+{
+    return left.waitTotal > right.waitTotal;
+}
+
+void ElunaUtil::LockProfiler::GetTopSites(std::vector<SiteStats>& top, uint32 limit)
+{
+    top.clear();
+    for (uint32 i = 0; i < SITE_SLOTS; ++i)
+    {
+        const SiteSlot& slot = siteSlots[i];
+        SiteStats siteStat;
+        siteStat.site = slot.site.load(std::memory_order_relaxed);
+        siteStat.count = slot.count.load(std::memory_order_relaxed);
+        if (!siteStat.site || !siteStat.count)
+            continue;
+        siteStat.waitTotal = slot.waitTotal.load(std::memory_order_relaxed);
+        siteStat.waitMax = slot.waitMax.load(std::memory_order_relaxed);
+        top.push_back(siteStat);
+    }
+
+    std::sort(top.begin(), top.end(), SiteWaitOrderPred);
+    if (top.size() > limit)
+        top.resize(limit);
+}
+
+void ElunaUtil::LockProfiler::Reset()
+{
+    for (uint32 kind = 0; kind < LOCK_KIND_COUNT; ++kind)
+    {
+        Stats& stat = stats[kind];
+        stat.count = 0;
+        stat.waitTotal = 0;
+        stat.holdTotal = 0;
+        stat.waitMax = 0;
+        for (uint32 i = 0; i < BUCKET_COUNT; ++i)
+        {
+            stat.wait[i] = 0;
+            stat.hold[i] = 0;
+        }
+    }
+
+    for (uint32 i = 0; i < SITE_SLOTS; ++i)
+    {
+        SiteSlot& slot = siteSlots[i];
+        slot.count = 0;
+        slot.waitTotal = 0;
+        slot.waitMax = 0;
+    }
+}
+
+void ElunaUtil::LockProfiler::Dump()
+{
+    static const char* names[LOCK_KIND_COUNT] = { "state", "read", "write" };
+
+    if (!enabled)
+    {
+        ELUNA_LOG_INFO("[Eluna]: Lock profiling is disabled, set Eluna.LockProfiling = 1 to enable it");
+        return;
+    }
+
+    for (uint32 kind = 0; kind < LOCK_KIND_COUNT; ++kind)
+    {
+        const Stats& stat = stats[kind];
+        uint64 count = stat.count.load();
+        ELUNA_LOG_INFO("[Eluna]: %s locks: %llu acquired, wait total %llu us max %llu us, hold total %llu us", names[kind],
+            (unsigned long long)count, (unsigned long long)stat.waitTotal.load(), (unsigned long long)stat.waitMax.load(), (unsigned long long)stat.holdTotal.load());
+
+        std::string waits, holds;
+        for (uint32 i = 0; i < BUCKET_COUNT; ++i)
+        {
+            waits += " " + std::to_string((unsigned long long)stat.wait[i].load());
+            holds += " " + std::to_string((unsigned long long)stat.hold[i].load());
+        }
+        ELUNA_LOG_INFO("[Eluna]:   wait buckets (<1us, <2us, <4us ...):%s", waits.c_str());
+        ELUNA_LOG_INFO("[Eluna]:   hold buckets (<1us, <2us, <4us ...):%s", holds.c_str());
+    }
+
+    std::vector<SiteStats> top;
+    GetTopSites(top, 10);
+    for (std::vector<SiteStats>::const_iterator it = top.begin(); it != top.end(); ++it)
+        ELUNA_LOG_INFO("[Eluna]: waited in %s: %llu acquired, wait total %llu us max %llu us", it->site,
+            (unsigned long long)it->count, (unsigned long long)it->waitTotal, (unsigned long long)it->waitMax);
+}
@@ -29,6 +29,10 @@
 #include <boost/thread/locks.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #endif
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
 
 #ifdef TRINITY
 typedef QueryResult ElunaQuery;
@@ -116,6 +120,110 @@ namespace ElunaUtil
         bool i_nearest;
     };
 
+    /*
+     * Records how long Eluna locks are waited for and held, enabled with Eluna.LockProfiling.
+     * Acquisitions of the state locks (LOCK_ELUNA) are also counted per acquiring function.
+     */
+    class LockProfiler
+    {
+    public:
+        enum Kind
+        {
+            LOCK_STATE,     // LOCK_ELUNA and Eluna::Guard
+            LOCK_READ,      // RWLockable::ReadGuard
+            LOCK_WRITE,     // RWLockable::WriteGuard
+            LOCK_KIND_COUNT
+        };
+
+        // Bucket i counts the times under 2^i microseconds, the last bucket counts the rest
+        static const uint32 BUCKET_COUNT = 16;
+
+        struct Stats
+        {
+            std::atomic<uint64> count;
+            std::atomic<uint64> waitTotal;  // microseconds
+            std::atomic<uint64> holdTotal;  // microseconds
+            std::atomic<uint64> waitMax;    // microseconds
+            std::atomic<uint64> wait[BUCKET_COUNT];
+            std::atomic<uint64> hold[BUCKET_COUNT];
+        };
+
+        struct SiteStats
+        {
+            SiteStats() : site(NULL), count(0), waitTotal(0), waitMax(0) { }
+            const char* site;
+            uint64 count;
+            uint64 waitTotal;   // microseconds
+            uint64 waitMax;     // microseconds
+        };
+
+        static bool IsEnabled() { return enabled; }
+        static void SetEnabled(bool enable) { enabled = enable; }
+
+        // Returns the time in microseconds, 0 when profiling is disabled
+        static uint64 Now()
+        {
+            if (!enabled)
+                return 0;
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + 1;
+        }
+
+        static void Record(Kind kind, const char* site, uint64 wait, uint64 hold);
+        static const Stats& GetStats(Kind kind) { return stats[kind]; }
+        // Returns the sites with the most total wait time, most first
+        static void GetTopSites(std::vector<SiteStats>& sites, uint32 limit);
+        static void Reset();
+        // Writes the stats to the log
+        static void Dump();
+
+    private:
+        static bool enabled;
+        static Stats stats[LOCK_KIND_COUNT];
+    };
+
+    // Scoped lock guard that reports to the LockProfiler. The wrapped guard is constructed between the two time reads
+    //   and the times are recorded only after it has released the lock
+    template<typename Guard, typename Mutex, LockProfiler::Kind K>
+    class ProfiledGuard
+    {
+    public:
+        explicit ProfiledGuard(Mutex& mutex, const char* site = NULL) :
+            times(site), guard(mutex)
+        {
+            if (times.start)
+                times.acquired = LockProfiler::Now();
+        }
+
+        ~ProfiledGuard()
+        {
+            if (times.start)
+                times.released = LockProfiler::Now();
+        }
+
+    private:
+        ProfiledGuard(ProfiledGuard const&);
+        ProfiledGuard& operator=(ProfiledGuard const&);
+
+        // Declared before the guard so it is destroyed after the guard releases the lock
+        struct Times
+        {
+            explicit Times(const char* _site) : site(_site), start(LockProfiler::Now()), acquired(0), released(0) { }
+            ~Times()
+            {
+                if (start)
+                    LockProfiler::Record(K, site, acquired - start, released - acquired);
+            }
+
+            const char* site;
+            uint64 start;
+            uint64 acquired;
+            uint64 released;
+        };
+
+        Times times;
+        Guard guard;
+    };
+
     /*
      * Usage:
      * Inherit this class, then when needing lock, use
@@ -131,12 +239,12 @@ namespace ElunaUtil
 
 #ifdef USING_BOOST
         typedef boost::shared_mutex LockType;
-        typedef boost::shared_lock<boost::shared_mutex> ReadGuard;
-        typedef boost::unique_lock<boost::shared_mutex> WriteGuard;
+        typedef ProfiledGuard<boost::shared_lock<boost::shared_mutex>, LockType, LockProfiler::LOCK_READ> ReadGuard;
+        typedef ProfiledGuard<boost::unique_lock<boost::shared_mutex>, LockType, LockProfiler::LOCK_WRITE> WriteGuard;
 #else
         typedef ACE_RW_Thread_Mutex LockType;
-        typedef ACE_Read_Guard<LockType> ReadGuard;
-        typedef ACE_Write_Guard<LockType> WriteGuard;
+        typedef ProfiledGuard<ACE_Read_Guard<LockType>, LockType, LockProfiler::LOCK_READ> ReadGuard;
+        typedef ProfiledGuard<ACE_Write_Guard<LockType>, LockType, LockProfiler::LOCK_WRITE> WriteGuard;
 #endif
 
         LockType& GetLock() { return _lock; }
@@ -0,0 +1,230 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaWorkerPool.h"
+#include "ElunaSharedData.h"
+
+extern "C"
+{
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+};
+
+ElunaWorkerPool* ElunaWorkerPool::instance = NULL;
+std::mutex ElunaWorkerPool::instanceLock;
+uint32 ElunaWorkerPool::workerCount = 0;
+uint32 ElunaWorkerPool::instructionLimit = 0;
+
+// Instructions between the checks of JobHook
+static const int JOB_HOOK_INTERVAL = 10000;
+
+// Pool and instructions run by the job of the worker thread, read by JobHook
+static thread_local ElunaWorkerPool* workerPool = NULL;
+static thread_local uint64 jobInstructions = 0;
+
+ElunaAsyncResults::~ElunaAsyncResults()
+{
+    Close();
+}
+
+void ElunaAsyncResults::Push(ElunaAsyncJob* job)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (closed)
+    {
+        delete job;
+        return;
+    }
+    jobs.push_back(job);
+}
+
+void ElunaAsyncResults::TakeAll(std::vector<ElunaAsyncJob*>& taken)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    taken.swap(jobs);
+}
+
+void ElunaAsyncResults::Close()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    for (std::vector<ElunaAsyncJob*>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+        delete *it;
+    jobs.clear();
+}
+
+void ElunaWorkerPool::Start(uint32 workers, uint32 limit)
+{
+    std::lock_guard<std::mutex> guard(instanceLock);
+    workerCount = workers;
+    instructionLimit = limit;
+}
+
+void ElunaWorkerPool::Stop()
+{
+    std::lock_guard<std::mutex> guard(instanceLock);
+    delete instance;
+    instance = NULL;
+    workerCount = 0;
+}
+
+void ElunaWorkerPool::Enqueue(ElunaAsyncJob* job)
+{
+    ASSERT(job->owner);
+    ElunaWorkerPool* pool;
+    {
+        std::lock_guard<std::mutex> guard(instanceLock);
+        ASSERT(workerCount);
+        if (!instance)
+            instance = new ElunaWorkerPool(workerCount);
+        pool = instance;
+
+        // Stop waits for instanceLock, the pool stays alive while the job is queued
+        std::lock_guard<std::mutex> queueGuard(pool->lock);
+        pool->queue.push_back(job);
+    }
+    pool->jobAdded.notify_one();
+}
+
+ElunaWorkerPool::ElunaWorkerPool(uint32 workers) : stopping(false)
+{
+    for (uint32 i = 0; i < workers; ++i)
+        threads.push_back(std::thread(&ElunaWorkerPool::Work, this));
+}
+
+ElunaWorkerPool::~ElunaWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    jobAdded.notify_all();
+
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    for (std::deque<ElunaAsyncJob*>::const_iterator it = queue.begin(); it != queue.end(); ++it)
+        delete *it;
+}
+
+void ElunaWorkerPool::Work()
+{
+    workerPool = this;
+
+    while (true)
+    {
+        ElunaAsyncJob* job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping && queue.empty())
+                jobAdded.wait(guard);
+            if (stopping)
+                break;
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        Run(job);
+
+        std::shared_ptr<ElunaAsyncResults> owner;
+        owner.swap(job->owner);
+        owner->Push(job);
+    }
+}
+
+lua_State* ElunaWorkerPool::CreateWorkerState()
+{
+    lua_State* L = luaL_newstate();
+
+    static const luaL_Reg libs[] =
+    {
+        { "_G", luaopen_base },
+        { LUA_TABLIBNAME, luaopen_table },
+        { LUA_STRLIBNAME, luaopen_string },
+        { LUA_MATHLIBNAME, luaopen_math },
+        { LUA_BITLIBNAME, luaopen_bit32 },
+        { NULL, NULL }
+    };
+    for (const luaL_Reg* lib = libs; lib->func; ++lib)
+    {
+        luaL_requiref(L, lib->name, lib->func, 1);
+        lua_pop(L, 1);
+    }
+
+    // No file access
+    lua_pushnil(L);
+    lua_setglobal(L, "dofile");
+    lua_pushnil(L);
+    lua_setglobal(L, "loadfile");
+    return L;
+}
+
+void ElunaWorkerPool::JobHook(lua_State* L, lua_Debug* /*ar*/)
+{
+    if (workerPool->stopping)
+        luaL_error(L, "RunAsync job stopped, the server is shutting down");
+
+    jobInstructions += JOB_HOOK_INTERVAL;
+    if (instructionLimit && jobInstructions >= instructionLimit)
+    {
+        // Check every instruction from now on so the job can't go on by catching the error
+        lua_sethook(L, &JobHook, LUA_MASKCOUNT, 1);
+        luaL_error(L, "RunAsync job ran over Eluna.AsyncInstructionLimit (%u instructions)", instructionLimit);
+    }
+}
+
+void ElunaWorkerPool::Run(ElunaAsyncJob* job)
+{
+    job->success = false;
+    job->resultCount = 0;
+
+    // A new state for every job so nothing a job leaves in its globals reaches the next one
+    lua_State* L = CreateWorkerState();
+    jobInstructions = 0;
+    lua_sethook(L, &JobHook, LUA_MASKCOUNT, JOB_HOOK_INTERVAL);
+
+    if (luaL_loadbufferx(L, job->function.data(), job->function.size(), "=RunAsync", "b") != LUA_OK)
+    {
+        job->results = lua_tostring(L, -1);
+        lua_close(L);
+        return;
+    }
+
+    // Stack: function
+    ElunaSharedData::Deserialize(L, job->arguments, false);
+    for (uint32 i = 1; i <= job->argumentCount; ++i)
+        lua_rawgeti(L, 2, i);
+    lua_remove(L, 2);
+    // Stack: function, [arguments]
+
+    if (lua_pcall(L, job->argumentCount, LUA_MULTRET, 0) != LUA_OK)
+    {
+        const char* error = lua_tostring(L, -1);
+        job->results = error ? error : "error in RunAsync function";
+        lua_close(L);
+        return;
+    }
+
+    // Stack: [results]
+    int count = lua_gettop(L);
+    lua_createtable(L, count, 0);
+    for (int i = 1; i <= count; ++i)
+    {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i);
+    }
+
+    if (ElunaSharedData::Serialize(L, -1, job->results))
+    {
+        job->success = true;
+        job->resultCount = count;
+    }
+    else
+        job->results = "RunAsync function returned a value that can not be passed between lua states";
+
+    lua_close(L);
+}
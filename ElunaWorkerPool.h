@@ -0,0 +1,97 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_WORKER_POOL_H
+#define _ELUNA_WORKER_POOL_H
+
+#include "ElunaUtility.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct lua_State;
+struct lua_Debug;
+class ElunaAsyncResults;
+
+// Work given to RunAsync. Everything is serialized, see ElunaSharedData
+struct ElunaAsyncJob
+{
+    ElunaAsyncJob() : argumentCount(0), callback(0), success(false), resultCount(0) { }
+
+    std::string function;   // Function bytecode
+    std::string arguments;  // Table of the arguments
+    uint32 argumentCount;
+    int callback;           // Function reference in the owner state
+    std::shared_ptr<ElunaAsyncResults> owner;
+
+    bool success;
+    std::string results;    // Table of the results or the error message
+    uint32 resultCount;
+};
+
+/*
+ * Finished jobs of one lua state, taken by the state on its update.
+ * Closed when the lua state is closed, results of jobs still running are then discarded.
+ */
+class ElunaAsyncResults
+{
+public:
+    ElunaAsyncResults() : closed(false) { }
+    ~ElunaAsyncResults();
+
+    void Push(ElunaAsyncJob* job);
+    void TakeAll(std::vector<ElunaAsyncJob*>& jobs);
+    void Close();
+
+private:
+    std::mutex lock;
+    std::vector<ElunaAsyncJob*> jobs;
+    bool closed;
+};
+
+/*
+ * Threads running RunAsync jobs in sandboxed lua states.
+ * Every job gets a new lua state with only the base, table, string, math and bit32 libraries and no access to game objects.
+ * The threads are started on the first job.
+ */
+class ElunaWorkerPool
+{
+public:
+    // Sets the amount of worker threads and instructions a job may run, 0 for no limit. Threads are not started yet
+    static void Start(uint32 workers, uint32 instructionLimit);
+    static void Stop();
+    static bool IsEnabled() { return workerCount != 0; }
+    // Queues the job, starting the threads if needed. Its owner must be set
+    static void Enqueue(ElunaAsyncJob* job);
+
+private:
+    static ElunaWorkerPool* instance;
+    static std::mutex instanceLock;
+    static uint32 workerCount;
+    static uint32 instructionLimit;
+
+    ElunaWorkerPool(uint32 workers);
+    ~ElunaWorkerPool();
+
+    void Work();
+    static lua_State* CreateWorkerState();
+    void Run(ElunaAsyncJob* job);
+    // Count hook of jobs, errors once the job is out of instructions or the pool is stopping
+    static void JobHook(lua_State* L, lua_Debug* ar);
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable jobAdded;
+    std::deque<ElunaAsyncJob*> queue;
+    std::atomic<bool> stopping;
+};
+
+#endif
@@ -85,6 +85,13 @@ bool Eluna::OnQuestAccept(Player* pPlayer, GameObject* pGameObject, Quest const*
 
 void Eluna::UpdateAI(GameObject* pGameObject, uint32 diff)
 {
+    Eluna* E = GetMapState(pGameObject->GetMap());
+    if (E != this)
+    {
+        E->UpdateAI(pGameObject, diff);
+        return;
+    }
+
     if (!GameObjectEventBindings->HasEvents(GAMEOBJECT_EVENT_ON_AIUPDATE, pGameObject->GetEntry()))
         return;
 
@@ -92,7 +99,7 @@ void Eluna::UpdateAI(GameObject* pGameObject, uint32 diff)
     pGameObject->elunaEvents->Update(diff);
     Push(pGameObject);
     Push(diff);
-    CallAllFunctions(GameObjectEventBindings, GAMEOBJECT_EVENT_ON_AIUPDATE, pGameObject->GetEntry());
+    CallAllUpdateFunctions(GameObjectEventBindings, GAMEOBJECT_EVENT_ON_AIUPDATE, pGameObject->GetEntry(), pGameObject->GET_GUID(), diff);
 }
 
 bool Eluna::OnQuestReward(Player* pPlayer, GameObject* pGameObject, Quest const* pQuest, uint32 opt)
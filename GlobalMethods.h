@@ -27,6 +27,29 @@ namespace LuaGlobalFunctions
         return 1;
     }
 
+    /**
+     * Returns the [Map] of the Lua state the script runs in, or nil in the world state.
+     *
+     * With `Eluna.MapStates` enabled every map gets a Lua state of its own that loads all scripts, besides the world state.
+     * The world state gets world, player, guild, group and other server wide hooks, while map states get the creature,
+     * gameobject and map hooks of their map. Code at the top level of a script runs once in every state,
+     * so global timed events, cron events, [Global:RunAsync] jobs and database work started there run once per state.
+     * Check the result of this function to keep such code in the state it belongs to:
+     *
+     *     if not GetStateMap() then
+     *         CreateCronEvent("0 12 * * *", Announce) -- runs only in the world state
+     *     end
+     *
+     * Without map states this always returns nil.
+     *
+     * @return [Map] map
+     */
+    int GetStateMap(Eluna* E, lua_State* L)
+    {
+        Eluna::Push(L, E->GetOwnerMap());
+        return 1;
+    }
+
     /**
      * Returns emulator's name.
      *
@@ -75,6 +98,288 @@ namespace LuaGlobalFunctions
         return 1;
     }
 
+    /**
+     * Returns how many times pushing an object to Lua reused an existing userdata and how many times a new one had to be created.
+     *
+     *     local hits, misses = GetObjectStoreStats()
+     *     print("object store hit rate", hits / math.max(hits + misses, 1))
+     *
+     * @return double hits
+     * @return double misses
+     */
+    int GetObjectStoreStats(Eluna* E, lua_State* L)
+    {
+        Eluna::Push(L, (double)E->objectStoreHits);
+        Eluna::Push(L, (double)E->objectStoreMisses);
+        return 2;
+    }
+
+    /**
+     * Returns the value stored in the shared data store under the key or nil.
+     *
+     * The shared data store is shared by all Lua states and can be used without the global Eluna lock.
+     * The returned value is a copy, changing a returned table does not change the stored value.
+     *
+     * @param string key
+     * @return nil/bool/number/string/int64/uint64/table value
+     */
+    int GetSharedData(Eluna* /*E*/, lua_State* L)
+    {
+        std::string key = Eluna::CHECKVAL<std::string>(L, 1);
+
+        std::string value;
+        if (sElunaSharedData.Get(key, value))
+            ElunaSharedData::Deserialize(L, value);
+        else
+            Eluna::Push(L);
+        return 1;
+    }
+
+    /**
+     * Stores a copy of the value in the shared data store under the key. A nil value removes the key.
+     *
+     * Booleans, numbers, strings, 64 bit integers and tables of those can be stored. Tables can be nested but can't be used as keys.
+     *
+     * @param string key
+     * @param nil/bool/number/string/int64/uint64/table value
+     */
+    int SetSharedData(Eluna* /*E*/, lua_State* L)
+    {
+        std::string key = Eluna::CHECKVAL<std::string>(L, 1);
+        luaL_checkany(L, 2);
+
+        if (lua_isnil(L, 2))
+        {
+            sElunaSharedData.Remove(key);
+            return 0;
+        }
+
+        std::string value;
+        if (!ElunaSharedData::Serialize(L, 2, value))
+            return luaL_argerror(L, 2, "value can not be stored in shared data");
+
+        sElunaSharedData.Set(key, value);
+        return 0;
+    }
+
+    /**
+     * Adds the amount to the number stored in the shared data store under the key and returns the new value.
+     * A missing value counts as 0. The addition is atomic, which makes this usable as a counter shared by all Lua states.
+     *
+     * @param string key
+     * @param number amount = 1
+     * @return number value
+     */
+    int AddSharedData(Eluna* /*E*/, lua_State* L)
+    {
+        std::string key = Eluna::CHECKVAL<std::string>(L, 1);
+        double amount = Eluna::CHECKVAL<double>(L, 2, 1);
+
+        double result;
+        if (!sElunaSharedData.Add(key, amount, result))
+            return luaL_argerror(L, 1, "stored value is not a number");
+
+        Eluna::Push(L, result);
+        return 1;
+    }
+
+    static void PushLockStats(lua_State* L, const ElunaUtil::LockProfiler::Stats& stats)
+    {
+        lua_newtable(L);
+        Eluna::Push(L, double(stats.count.load()));
+        lua_setfield(L, -2, "count");
+        Eluna::Push(L, double(stats.waitTotal.load()));
+        lua_setfield(L, -2, "waitTotal");
+        Eluna::Push(L, double(stats.waitMax.load()));
+        lua_setfield(L, -2, "waitMax");
+        Eluna::Push(L, double(stats.holdTotal.load()));
+        lua_setfield(L, -2, "holdTotal");
+
+        lua_createtable(L, ElunaUtil::LockProfiler::BUCKET_COUNT, 0);
+        for (uint32 i = 0; i < ElunaUtil::LockProfiler::BUCKET_COUNT; ++i)
+        {
+            Eluna::Push(L, double(stats.wait[i].load()));
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, "wait");
+
+        lua_createtable(L, ElunaUtil::LockProfiler::BUCKET_COUNT, 0);
+        for (uint32 i = 0; i < ElunaUtil::LockProfiler::BUCKET_COUNT; ++i)
+        {
+            Eluna::Push(L, double(stats.hold[i].load()));
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, "hold");
+    }
+
+    /**
+     * Returns the lock profiler stats or nil if Eluna.LockProfiling is disabled.
+     *
+     * The table has the fields state (LOCK_ELUNA), read and write (reader/writer locks of binding stores, timed events and such).
+     * Each has count, waitTotal, waitMax and holdTotal in microseconds and the histograms wait and hold,
+     * where index i counts the times under 2^(i-1) microseconds and the last index the rest.
+     * The field sites has the functions that waited most for LOCK_ELUNA as { site, count, waitTotal, waitMax } tables.
+     * The same stats are written to the log with the command `eluna locks`, `eluna locks reset` resets them.
+     *
+     * @param uint32 sites = 10 : how many sites to return
+     * @return table stats
+     */
+    int GetLockStats(Eluna* /*E*/, lua_State* L)
+    {
+        uint32 limit = Eluna::CHECKVAL<uint32>(L, 1, 10);
+
+        if (!ElunaUtil::LockProfiler::IsEnabled())
+        {
+            Eluna::Push(L);
+            return 1;
+        }
+
+        lua_newtable(L);
+        PushLockStats(L, ElunaUtil::LockProfiler::GetStats(ElunaUtil::LockProfiler::LOCK_STATE));
+        lua_setfield(L, -2, "state");
+        PushLockStats(L, ElunaUtil::LockProfiler::GetStats(ElunaUtil::LockProfiler::LOCK_READ));
+        lua_setfield(L, -2, "read");
+        PushLockStats(L, ElunaUtil::LockProfiler::GetStats(ElunaUtil::LockProfiler::LOCK_WRITE));
+        lua_setfield(L, -2, "write");
+
+        std::vector<ElunaUtil::LockProfiler::SiteStats> sites;
+        ElunaUtil::LockProfiler::GetTopSites(sites, limit);
+        lua_createtable(L, int(sites.size()), 0);
+        for (size_t i = 0; i < sites.size(); ++i)
+        {
+            lua_newtable(L);
+            Eluna::Push(L, sites[i].site);
+            lua_setfield(L, -2, "site");
+            Eluna::Push(L, double(sites[i].count));
+            lua_setfield(L, -2, "count");
+            Eluna::Push(L, double(sites[i].waitTotal));
+            lua_setfield(L, -2, "waitTotal");
+            Eluna::Push(L, double(sites[i].waitMax));
+            lua_setfield(L, -2, "waitMax");
+            lua_rawseti(L, -2, int(i + 1));
+        }
+        lua_setfield(L, -2, "sites");
+        return 1;
+    }
+
+    /**
+     * Resets the lock profiler stats, see [GetLockStats].
+     */
+    int ResetLockStats(Eluna* /*E*/, lua_State* /*L*/)
+    {
+        ElunaUtil::LockProfiler::Reset();
+        return 0;
+    }
+
+    /**
+     * Returns the timed event counters of all processors.
+     *
+     * Deferred events are due events carried over to the next update because the budget set with
+     * `Eluna.EventBudgetCount` or `Eluna.EventBudgetMicroseconds` ran out. The budget is shared by all objects
+     * updated in the same world or map update. Only events that are called count, paused events don't.
+     *
+     *     local executed, deferred, lateness = GetEventStats()
+     *     print("average event lateness", lateness / math.max(executed, 1))
+     *
+     * @return double executed : amount of event calls
+     * @return double deferred : amount of times due events were carried over
+     * @return double lateness : total milliseconds the calls were made after their due time
+     */
+    int GetEventStats(Eluna* /*E*/, lua_State* L)
+    {
+        const ElunaEventProcessor::Stats& stats = ElunaEventProcessor::GetStats();
+        Eluna::Push(L, double(stats.executed.load()));
+        Eluna::Push(L, double(stats.deferred.load()));
+        Eluna::Push(L, double(stats.lateness.load()));
+        return 3;
+    }
+
+    /**
+     * Resets the timed event counters, see [GetEventStats].
+     */
+    int ResetEventStats(Eluna* /*E*/, lua_State* /*L*/)
+    {
+        ElunaEventProcessor::ResetStats();
+        return 0;
+    }
+
+    static int AsyncFunctionWriter(lua_State* /*L*/, const void* data, size_t size, void* out)
+    {
+        static_cast<std::string*>(out)->append(static_cast<const char*>(data), size);
+        return 0;
+    }
+
+    /**
+     * Runs the function on a background thread and calls the callback with its results on a later server update.
+     *
+     * The function runs in a new worker Lua state that only has the base, table, string, math and bit32 libraries.
+     * Globals set by the function are not seen by later jobs.
+     * A function that runs more instructions than `Eluna.AsyncInstructionLimit` fails with an error.
+     * It can't use game objects, Eluna functions or upvalues (local variables of enclosing functions), everything it needs must be passed in args.
+     * The arguments and results are copied like values of the shared data store, see [SetSharedData].
+     * The callback is called as callback(true, results...) or callback(false, errorMessage).
+     *
+     *     RunAsync(function(scores)
+     *         table.sort(scores, function(a, b) return a > b end)
+     *         return scores
+     *     end, { scores }, function(success, sorted)
+     *         if success then print(sorted[1]) end
+     *     end)
+     *
+     * @param function function : function to run in a worker state
+     * @param table args : array of arguments for the function, can be nil
+     * @param function callback : function called with the results
+     */
+    int RunAsync(Eluna* E, lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        if (!lua_isnoneornil(L, 2))
+            luaL_checktype(L, 2, LUA_TTABLE);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+
+        if (!ElunaWorkerPool::IsEnabled())
+            return luaL_error(L, "RunAsync is disabled, Eluna.AsyncWorkers is 0");
+
+        // Loaded functions get the worker's globals as their first upvalue, others would be lost
+        for (int i = 1; const char* name = lua_getupvalue(L, 1, i); ++i)
+        {
+            lua_pop(L, 1);
+            if (strcmp(name, "_ENV") != 0)
+                return luaL_argerror(L, 1, "function can not use upvalues");
+        }
+
+        ElunaAsyncJob* job = new ElunaAsyncJob();
+
+        lua_pushvalue(L, 1);
+        int dumped = lua_dump(L, &AsyncFunctionWriter, &job->function);
+        lua_pop(L, 1);
+        if (dumped != 0)
+        {
+            delete job;
+            return luaL_argerror(L, 1, "unable to dump function");
+        }
+
+        if (lua_isnoneornil(L, 2))
+            lua_newtable(L);
+        else
+            lua_pushvalue(L, 2);
+        job->argumentCount = lua_rawlen(L, -1);
+        bool serialized = ElunaSharedData::Serialize(L, -1, job->arguments);
+        lua_pop(L, 1);
+        if (!serialized)
+        {
+            delete job;
+            return luaL_argerror(L, 2, "arguments can not be passed to a worker state");
+        }
+
+        lua_pushvalue(L, 3);
+        job->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+        job->owner = E->asyncResults;
+
+        ElunaWorkerPool::Enqueue(job);
+        return 0;
+    }
+
     /**
      * Returns [Quest] template
      *
@@ -484,17 +789,42 @@ namespace LuaGlobalFunctions
         return 1;
     }
 
+    // Reads the optional table after shots, { interval = milliseconds, deferred = boolean }.
+    // Eluna::Register checks that the event supports the options given
+    static void RegisterOptionsHelper(lua_State* L, int index, uint32& interval, bool& deferred)
+    {
+        interval = 0;
+        deferred = false;
+        if (lua_isnoneornil(L, index))
+            return;
+
+        luaL_checktype(L, index, LUA_TTABLE);
+        lua_getfield(L, index, "interval");
+        if (!lua_isnil(L, -1))
+        {
+            if (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)
+                luaL_argerror(L, index, "options.interval must be a non negative number");
+            interval = uint32(lua_tonumber(L, -1));
+        }
+        lua_getfield(L, index, "deferred");
+        deferred = lua_toboolean(L, -1) != 0;
+        lua_pop(L, 2);
+    }
+
     static void RegisterEntryHelper(Eluna* E, lua_State* L, int regtype)
     {
         uint32 entry = Eluna::CHECKVAL<uint32>(L, 1);
         uint32 ev = Eluna::CHECKVAL<uint32>(L, 2);
         luaL_checktype(L, 3, LUA_TFUNCTION);
         uint32 shots = Eluna::CHECKVAL<uint32>(L, 4, 0);
+        uint32 interval;
+        bool deferred;
+        RegisterOptionsHelper(L, 5, interval, deferred);
 
         lua_pushvalue(L, 3);
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef >= 0)
-            E->Register(regtype, entry, 0, 0, ev, functionRef, shots);
+            E->Register(regtype, entry, 0, 0, ev, functionRef, shots, deferred, interval);
         else
             luaL_argerror(L, 3, "unable to make a ref to function");
     }
@@ -504,11 +834,14 @@ namespace LuaGlobalFunctions
         uint32 ev = Eluna::CHECKVAL<uint32>(L, 1);
         luaL_checktype(L, 2, LUA_TFUNCTION);
         uint32 shots = Eluna::CHECKVAL<uint32>(L, 3, 0);
+        uint32 interval;
+        bool deferred;
+        RegisterOptionsHelper(L, 4, interval, deferred);
 
         lua_pushvalue(L, 2);
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef >= 0)
-            E->Register(regtype, 0, 0, 0, ev, functionRef, shots);
+            E->Register(regtype, 0, 0, 0, ev, functionRef, shots, deferred, interval);
         else
             luaL_argerror(L, 2, "unable to make a ref to function");
     }
@@ -520,11 +853,14 @@ namespace LuaGlobalFunctions
         uint32 ev = Eluna::CHECKVAL<uint32>(L, 3);
         luaL_checktype(L, 4, LUA_TFUNCTION);
         uint32 shots = Eluna::CHECKVAL<uint32>(L, 5, 0);
+        uint32 interval;
+        bool deferred;
+        RegisterOptionsHelper(L, 6, interval, deferred);
 
         lua_pushvalue(L, 4);
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef >= 0)
-            E->Register(regtype, 0, guid, instanceId, ev, functionRef, shots);
+            E->Register(regtype, 0, guid, instanceId, ev, functionRef, shots, deferred, interval);
         else
             luaL_argerror(L, 4, "unable to make a ref to function");
     }
@@ -590,6 +926,7 @@ namespace LuaGlobalFunctions
      * @param uint32 event : server event ID, refer to ServerEvents above
      * @param function function : function that will be called when the event occurs
      * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     * @param table options = nil : `{ interval = milliseconds }`, for the update events call the function once the diffs add up to the interval and pass their sum as the diff. Map updates add up per map
      */
     int RegisterServerEvent(Eluna* E, lua_State* L)
     {
@@ -652,9 +989,14 @@ namespace LuaGlobalFunctions
      * };
      * </pre>
      *
+     * A deferred handler is not called by the hook. The calls are recorded and the handler is called once per server tick
+     * as function(event, records), each record being an array of the hook's arguments with objects replaced by their GUIDs.
+     * Only PLAYER_EVENT_ON_LOOT_ITEM, PLAYER_EVENT_ON_KILL_PLAYER, PLAYER_EVENT_ON_KILL_CREATURE and PLAYER_EVENT_ON_LEVEL_CHANGE can be deferred.
+     *
      * @param uint32 event : [Player] event Id, refer to PlayerEvents above
      * @param function function : function to register
      * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     * @param table options = nil : `{ deferred = true }` to call the function later with all calls made since, see above
      */
     int RegisterPlayerEvent(Eluna* E, lua_State* L)
     {
@@ -685,9 +1027,14 @@ namespace LuaGlobalFunctions
      * };
      * </pre>
      *
+     * A deferred handler is not called by the hook. The calls are recorded and the handler is called once per server tick
+     * as function(event, records), each record being an array of the hook's arguments with the guild replaced by its ID and players by their GUIDs.
+     * Only GUILD_EVENT_ON_ADD_MEMBER and GUILD_EVENT_ON_BANK_EVENT can be deferred.
+     *
      * @param uint32 event : [Guild] event Id, refer to GuildEvents above
      * @param function function : function to register
      * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     * @param table options = nil : `{ deferred = true }` to call the function later with all calls made since, see above
      */
     int RegisterGuildEvent(Eluna* E, lua_State* L)
     {
@@ -933,14 +1280,21 @@ namespace LuaGlobalFunctions
      *     CREATURE_EVENT_ON_DIALOG_STATUS                   = 35, // (event, player, creature)
      *     CREATURE_EVENT_ON_ADD                             = 36, // (event, creature)
      *     CREATURE_EVENT_ON_REMOVE                          = 37, // (event, creature)
+     *     CREATURE_EVENT_ON_AIUPDATE_BATCH                  = 38, // (event, creatures, diffs) - Can return an array of true to stop normal action
      *     CREATURE_EVENT_COUNT
      * };
      * </pre>
      *
+     * CREATURE_EVENT_ON_AIUPDATE_BATCH is called once per map update with arrays of the [Creature]s of the entry that updated and their diffs,
+     * instead of once per [Creature]. It is called after all [Creature]s of the map have updated, so they have already taken their normal action
+     * for the update. The returned array stops the normal action of the [Creature] at the same index on its next update, one update late.
+     * Use CREATURE_EVENT_ON_AIUPDATE when the action must be stopped on the same update.
+     *
      * @param uint32 entry : the ID of one or more [Creature]s
      * @param uint32 event : refer to CreatureEvents above
      * @param function function : function that will be called when the event occurs
      * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     * @param table options = nil : `{ interval = milliseconds }`, for CREATURE_EVENT_ON_AIUPDATE call the function once the diffs of the [Creature] add up to the interval and pass their sum as the diff
      */
     int RegisterCreatureEvent(Eluna* E, lua_State* L)
     {
@@ -1000,6 +1354,7 @@ namespace LuaGlobalFunctions
      * @param uint32 event : refer to CreatureEvents above
      * @param function function : function that will be called when the event occurs
      * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     * @param table options = nil : `{ interval = milliseconds }`, for CREATURE_EVENT_ON_AIUPDATE call the function once the diffs of the [Creature] add up to the interval and pass their sum as the diff
      */
     int RegisterUniqueCreatureEvent(Eluna* E, lua_State* L)
     {
@@ -1034,6 +1389,7 @@ namespace LuaGlobalFunctions
      * @param uint32 event : [GameObject] event Id, refer to GameObjectEvents above
      * @param function function : function to register
      * @param uint32 shots = 0 : the number of times the function will be called, 0 means "always call this function"
+     * @param table options = nil : `{ interval = milliseconds }`, for GAMEOBJECT_EVENT_ON_AIUPDATE call the function once the diffs of the [GameObject] add up to the interval and pass their sum as the diff
      */
     int RegisterGameObjectEvent(Eluna* E, lua_State* L)
     {
@@ -1210,9 +1566,12 @@ namespace LuaGlobalFunctions
      *
      * Repeats will decrease on each call if the event does not repeat indefinitely
      *
+     * The tag can be used to remove or pause a group of events at once, see [Global:RemoveEventsByTag].
+     *
      * @param function function : function to trigger when the time has passed
      * @param uint32 delay : set time in milliseconds for the event to trigger
      * @param uint32 repeats : how many times for the event to repeat, 0 is infinite
+     * @param string tag = nil : optional tag for the event
      * @return int eventId : unique ID for the timed event used to cancel it or nil
      */
     int CreateLuaEvent(Eluna* E, lua_State* L)
@@ -1220,17 +1579,71 @@ namespace LuaGlobalFunctions
         luaL_checktype(L, 1, LUA_TFUNCTION);
         uint32 delay = Eluna::CHECKVAL<uint32>(L, 2);
         uint32 repeats = Eluna::CHECKVAL<uint32>(L, 3);
+        std::string tag = Eluna::CHECKVAL<std::string>(L, 4, "");
 
         lua_pushvalue(L, 1);
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef != LUA_REFNIL && functionRef != LUA_NOREF)
         {
-            E->eventMgr->globalProcessor->AddEvent(functionRef, delay, repeats);
+            E->eventMgr->globalProcessor->AddEvent(E, functionRef, delay, repeats, tag.empty() ? 0 : E->eventMgr->GetTagId(tag));
+            Eluna::Push(L, functionRef);
+        }
+        return 1;
+    }
+
+    /**
+     * Registers a function to be called at the wall clock times matching the cron spec.
+     *
+     * The spec has five fields: minute, hour, day of month, month and day of week (Sunday is 0 or 7).
+     * Fields take `*`, values, ranges and steps separated by commas. Times are in the server's local time.
+     *
+     * When the passed function is called, the parameters `(eventId, time)` are passed to it, `time` is comparable to `os.time()`.
+     *
+     *     CreateCronEvent("0 4 * * *", DailyReset)        -- every day at 04:00
+     *     CreateCronEvent("0 * * * *", HourlyAnnounce)    -- every hour on the hour
+     *     CreateCronEvent("0-59/15 18-23 * * 5,6", Event) -- every 15 minutes on Friday and Saturday evenings
+     *
+     * @param string spec : cron spec of the times to call the function at
+     * @param function function : function to call
+     * @return int eventId : unique ID for the cron event used to remove it
+     */
+    int CreateCronEvent(Eluna* E, lua_State* L)
+    {
+        std::string spec = Eluna::CHECKVAL<std::string>(L, 1);
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+
+        ElunaCronSpec cronSpec;
+        if (!cronSpec.Parse(spec))
+            return luaL_argerror(L, 1, "valid cron spec expected");
+
+        time_t next = cronSpec.Next(time(NULL));
+        if (!next)
+            return luaL_argerror(L, 1, "cron spec never matches");
+
+        lua_pushvalue(L, 2);
+        int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (functionRef != LUA_REFNIL && functionRef != LUA_NOREF)
+        {
+            E->cronEvents.AddEvent(functionRef, cronSpec, next);
             Eluna::Push(L, functionRef);
         }
         return 1;
     }
 
+    /**
+     * Removes a cron event created with [Global:CreateCronEvent].
+     *
+     * @param int eventId : event Id to remove
+     */
+    int RemoveCronEvent(Eluna* E, lua_State* L)
+    {
+        int eventId = Eluna::CHECKVAL<int>(L, 1);
+
+        if (E->cronEvents.RemoveEvent(eventId))
+            luaL_unref(L, LUA_REGISTRYINDEX, eventId);
+        return 0;
+    }
+
     /**
      * Removes a global timed event specified by ID.
      *
@@ -1240,20 +1653,20 @@ namespace LuaGlobalFunctions
     int RemoveEventById(Eluna* E, lua_State* L)
     {
         int eventId = Eluna::CHECKVAL<int>(L, 1);
-        bool all_Events = Eluna::CHECKVAL<bool>(L, 1, false);
+        bool all_Events = Eluna::CHECKVAL<bool>(L, 2, false);
 
         // not thread safe
         if (all_Events)
             E->eventMgr->RemoveEvent(eventId);
         else
-            E->eventMgr->globalProcessor->RemoveEvent(eventId);
+            E->eventMgr->globalProcessor->RemoveEvent(E, eventId);
         return 0;
     }
 
     /**
      * Removes all global timed events.
      *
-     * @param bool all_Events = false : remove all events, not just global
+     * @param bool all_Events = false : remove all events registered from this Lua state, not just global
      */
     int RemoveEvents(Eluna* E, lua_State* L)
     {
@@ -1261,12 +1674,171 @@ namespace LuaGlobalFunctions
 
         // not thread safe
         if (all_Events)
-            E->eventMgr->RemoveEvents();
+            E->eventMgr->RemoveStateEvents();
         else
             E->eventMgr->globalProcessor->RemoveEvents();
         return 0;
     }
 
+    /**
+     * Removes all timed events created with the tag, global, [Map] and [WorldObject] events alike.
+     *
+     * @param string tag : tag given to [Global:CreateLuaEvent] or [WorldObject:RegisterEvent]
+     */
+    int RemoveEventsByTag(Eluna* E, lua_State* L)
+    {
+        std::string tag = Eluna::CHECKVAL<std::string>(L, 1);
+
+        // not thread safe
+        E->eventMgr->RemoveEventsByTag(tag);
+        return 0;
+    }
+
+    /**
+     * Pauses all timed events created with the tag.
+     *
+     * The timers of paused events keep running, but the events are not called and their repeats are not used up until resumed.
+     *
+     * @param string tag : tag given to [Global:CreateLuaEvent] or [WorldObject:RegisterEvent]
+     */
+    int PauseEventsByTag(Eluna* E, lua_State* L)
+    {
+        std::string tag = Eluna::CHECKVAL<std::string>(L, 1);
+
+        // not thread safe
+        E->eventMgr->SetEventsPausedByTag(tag, true);
+        return 0;
+    }
+
+    /**
+     * Resumes all timed events created with the tag paused with [Global:PauseEventsByTag].
+     *
+     * @param string tag : tag given to [Global:CreateLuaEvent] or [WorldObject:RegisterEvent]
+     */
+    int ResumeEventsByTag(Eluna* E, lua_State* L)
+    {
+        std::string tag = Eluna::CHECKVAL<std::string>(L, 1);
+
+        // not thread safe
+        E->eventMgr->SetEventsPausedByTag(tag, false);
+        return 0;
+    }
+
+    /**
+     * Runs the function as a coroutine with the given arguments.
+     *
+     * The coroutine runs until it finishes or waits with [Global:Wait], [Global:WaitUntil] or [Global:WaitEvent].
+     * Waiting coroutines are resumed on the world update, or on the map's update in map states.
+     * Objects passed to the coroutine can not be used after a wait, fetch them again by GUID.
+     *
+     *     StartCoroutine(function(guid)
+     *         Wait(2000)
+     *         -- ...
+     *         if WaitEvent("door_opened", 30000) then
+     *             -- ...
+     *         end
+     *     end, creature:GetGUID())
+     *
+     * @param function function : function to run as a coroutine
+     * @param ... : arguments passed to the function
+     */
+    int StartCoroutine(Eluna* E, lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        E->StartCoroutine(L, lua_gettop(L) - 1);
+        return 0;
+    }
+
+    /**
+     * Runs the function as a background job with the given arguments.
+     *
+     * A job is a coroutine, see [Global:StartCoroutine], that also pauses by itself after running
+     * for a while and continues on the next update. This spreads heavy one-off work over several updates.
+     * The amount run per update is set with `Eluna.JobInstructions` and `Eluna.JobMicroseconds` in the config.
+     *
+     * The job can't pause while inside a function called from C, such as a `table.sort` comparator.
+     *
+     * @param function function : function to run as a job
+     * @param ... : arguments passed to the function
+     */
+    int StartJob(Eluna* E, lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        E->StartCoroutine(L, lua_gettop(L) - 1, true);
+        return 0;
+    }
+
+    /**
+     * Pauses the coroutine started with [Global:StartCoroutine] for the given time.
+     *
+     * @param uint32 delay : time in milliseconds to wait, 0 waits until the next update
+     */
+    int Wait(Eluna* E, lua_State* L)
+    {
+        uint32 delay = Eluna::CHECKVAL<uint32>(L, 1);
+
+        if (!E->WaitCoroutine(L, Eluna::Coroutine::WAIT_TIME, delay))
+            return luaL_error(L, "Wait can only be called in a coroutine started with StartCoroutine");
+        return lua_yield(L, 0);
+    }
+
+    /**
+     * Pauses the coroutine started with [Global:StartCoroutine] until the predicate returns true.
+     *
+     * The predicate is called on every update until it returns true, errors or the timeout passes.
+     *
+     * @param function predicate : function returning true when the coroutine should continue
+     * @param uint32 timeout = 0 : time in milliseconds to wait at most, 0 for no timeout
+     * @return bool done : true if the predicate returned true, false on timeout or error
+     */
+    int WaitUntil(Eluna* E, lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        uint32 timeout = Eluna::CHECKVAL<uint32>(L, 2, 0);
+
+        lua_pushvalue(L, 1);
+        int predicateRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (!E->WaitCoroutine(L, Eluna::Coroutine::WAIT_UNTIL, timeout, predicateRef))
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, predicateRef);
+            return luaL_error(L, "WaitUntil can only be called in a coroutine started with StartCoroutine");
+        }
+        return lua_yield(L, 0);
+    }
+
+    /**
+     * Pauses the coroutine started with [Global:StartCoroutine] until the event is signaled with [Global:SignalEvent].
+     *
+     * @param string name : name of the event to wait for
+     * @param uint32 timeout = 0 : time in milliseconds to wait at most, 0 for no timeout
+     * @return bool signaled : true if the event was signaled, false on timeout
+     * @return ... : the arguments given to [Global:SignalEvent]
+     */
+    int WaitEvent(Eluna* E, lua_State* L)
+    {
+        const char* name = Eluna::CHECKVAL<const char*>(L, 1);
+        uint32 timeout = Eluna::CHECKVAL<uint32>(L, 2, 0);
+
+        if (!E->WaitCoroutine(L, Eluna::Coroutine::WAIT_EVENT, timeout, 0, name))
+            return luaL_error(L, "WaitEvent can only be called in a coroutine started with StartCoroutine");
+        return lua_yield(L, 0);
+    }
+
+    /**
+     * Resumes the coroutines waiting for the event with [Global:WaitEvent] on the next update.
+     *
+     * The coroutines get `true` and the given arguments as the return values of [Global:WaitEvent].
+     *
+     * @param string name : name of the event to signal
+     * @param ... : values returned to the waiting coroutines
+     */
+    int SignalEvent(Eluna* E, lua_State* L)
+    {
+        const char* name = Eluna::CHECKVAL<const char*>(L, 1);
+        E->SignalCoroutines(L, name, 2);
+        return 0;
+    }
+
     /**
      * Performs an in-game spawn and returns the [Creature] or [GameObject] spawned.
      *
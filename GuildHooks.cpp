@@ -17,6 +17,15 @@ using namespace Hooks;
 
 void Eluna::OnAddMember(Guild* guild, Player* player, uint32 plRank)
 {
+    if (GuildDeferredBindings->HasEvents(GUILD_EVENT_ON_ADD_MEMBER))
+    {
+        DeferredEvent* deferred = new DeferredEvent(REGTYPE_GUILD, GUILD_EVENT_ON_ADD_MEMBER);
+        deferred->Add(guild->GetId());
+        deferred->AddGuid(player->GET_GUID());
+        deferred->Add(plRank);
+        Defer(deferred);
+    }
+
     if (!GuildEventBindings->HasEvents(GUILD_EVENT_ON_ADD_MEMBER))
         return;
 
@@ -177,6 +186,19 @@ void Eluna::OnEvent(Guild* guild, uint8 eventType, uint32 playerGuid1, uint32 pl
 
 void Eluna::OnBankEvent(Guild* guild, uint8 eventType, uint8 tabId, uint32 playerGuid, uint32 itemOrMoney, uint16 itemStackCount, uint8 destTabId)
 {
+    if (GuildDeferredBindings->HasEvents(GUILD_EVENT_ON_BANK_EVENT))
+    {
+        DeferredEvent* deferred = new DeferredEvent(REGTYPE_GUILD, GUILD_EVENT_ON_BANK_EVENT);
+        deferred->Add(guild->GetId());
+        deferred->Add(eventType);
+        deferred->Add(tabId);
+        deferred->Add(playerGuid);
+        deferred->Add(itemOrMoney);
+        deferred->Add(itemStackCount);
+        deferred->Add(destTabId);
+        Defer(deferred);
+    }
+
     if (!GuildEventBindings->HasEvents(GUILD_EVENT_ON_BANK_EVENT))
         return;
 
@@ -37,6 +37,15 @@ int Eluna::SetupStack(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings
     lua_insert(L, first_argument_index);
     // Stack: event_id, [arguments]
 
+    // The traceback handler is pushed once here and used for all of the functions
+    //   instead of pushing one for every call, see CallOneFunction.
+    if (usetrace)
+    {
+        lua_pushcfunction(L, &StackTrace);
+        ++arguments_top;
+    }
+    // Stack: event_id, [arguments], traceback
+
     if (event_bindings)
         event_bindings->PushFuncRefs(L, (int)event_id);
 
@@ -45,7 +54,7 @@ int Eluna::SetupStack(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings
 
     if (guid_bindings)
         guid_bindings->PushFuncRefs(L, (int)event_id, guid, instanceId);
-    // Stack: event_id, [arguments], [functions]
+    // Stack: event_id, [arguments], traceback, [functions]
 
     int number_of_functions = lua_gettop(L) - arguments_top;
     return number_of_functions;
@@ -77,15 +86,20 @@ void Eluna::CallAllFunctions(EventBind<T>* event_bindings, EntryBind<T>* entry_b
     // Stack: [arguments]
 
     int number_of_functions = SetupStack(event_bindings, entry_bindings, guid_bindings, event_id, entry, guid, instanceId, number_of_arguments);
-    // Stack: event_id, [arguments], [functions]
+    // Stack: event_id, [arguments], traceback, [functions]
 
-    while (number_of_functions > 0)
+    // Enter lua once for all of the functions, fall back to calling them one by one
+    bool result;
+    if (!DispatchFunctions(number_of_functions, number_of_arguments, false, NULL, result))
     {
-        CallOneFunction(number_of_functions, number_of_arguments, 0);
-        --number_of_functions;
-        // Stack: event_id, [arguments], [functions - 1]
+        while (number_of_functions > 0)
+        {
+            CallOneFunction(number_of_functions, number_of_arguments, 0);
+            --number_of_functions;
+            // Stack: event_id, [arguments], traceback, [functions - 1]
+        }
     }
-    // Stack: event_id, [arguments]
+    // Stack: event_id, [arguments], traceback
 
     CleanUpStack(number_of_arguments);
     // Stack: (empty)
@@ -105,21 +119,73 @@ bool Eluna::CallAllFunctionsBool(EventBind<T>* event_bindings, EntryBind<T>* ent
     // Stack: [arguments]
 
     int number_of_functions = SetupStack(event_bindings, entry_bindings, guid_bindings, event_id, entry, guid, instanceId, number_of_arguments);
-    // Stack: event_id, [arguments], [functions]
+    // Stack: event_id, [arguments], traceback, [functions]
 
-    while (number_of_functions > 0)
+    // Enter lua once for all of the functions, fall back to calling them one by one
+    if (!DispatchFunctions(number_of_functions, number_of_arguments, default_value, NULL, result))
     {
-        int r = CallOneFunction(number_of_functions, number_of_arguments, 1);
-        --number_of_functions;
-        // Stack: event_id, [arguments], [functions - 1], result
+        while (number_of_functions > 0)
+        {
+            int r = CallOneFunction(number_of_functions, number_of_arguments, 1);
+            --number_of_functions;
+            // Stack: event_id, [arguments], traceback, [functions - 1], result
+
+            if (lua_isboolean(L, r) && (lua_toboolean(L, r) == 1) != default_value)
+                result = !default_value;
+
+            lua_pop(L, 1);
+            // Stack: event_id, [arguments], traceback, [functions - 1]
+        }
+    }
+    // Stack: event_id, [arguments], traceback
+
+    CleanUpStack(number_of_arguments);
+    // Stack: (empty)
+    return result;
+}
+
+/*
+ * Call all event handlers of a per update event, the diff must be the last argument pushed.
+ *
+ * Handlers registered with an interval are called only once the diffs they accumulated for the key
+ *   reach the interval, and get the accumulated time as their diff.
+ * Returns true if any of the handlers returned true.
+ */
+template<typename T>
+bool Eluna::CallAllUpdateFunctions(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings, UniqueBind<T>* guid_bindings, T event_id, uint32 entry, uint64 guid, uint32 instanceId, uint64 key, uint32 diff)
+{
+    bool result = false;
+    int number_of_arguments = this->push_counter;
+    // Stack: [arguments]
+
+    // The context is only used while pushing, the handlers may dispatch other events
+    UpdateContext context(key, diff);
+    updateContext = &context;
+    int number_of_functions = SetupStack(event_bindings, entry_bindings, guid_bindings, event_id, entry, guid, instanceId, number_of_arguments);
+    updateContext = NULL;
+    // Stack: event_id, [arguments], traceback, [functions]
 
-        if (lua_isboolean(L, r) && (lua_toboolean(L, r) == 1) != default_value)
-            result = !default_value;
+    ASSERT(context.diffs.size() == size_t(number_of_functions));
 
-        lua_pop(L, 1);
-        // Stack: event_id, [arguments], [functions - 1]
+    // Enter lua once for all of the functions, fall back to calling them one by one
+    if (!DispatchFunctions(number_of_functions, number_of_arguments, false, &context.diffs, result))
+    {
+        while (number_of_functions > 0)
+        {
+            // The functions are called from the top of the stack down
+            ReplaceArgument(context.diffs[number_of_functions - 1], number_of_arguments);
+            int r = CallOneFunction(number_of_functions, number_of_arguments, 1);
+            --number_of_functions;
+            // Stack: event_id, [arguments], traceback, [functions - 1], result
+
+            if (lua_isboolean(L, r) && lua_toboolean(L, r) == 1)
+                result = true;
+
+            lua_pop(L, 1);
+            // Stack: event_id, [arguments], traceback, [functions - 1]
+        }
     }
-    // Stack: event_id, [arguments]
+    // Stack: event_id, [arguments], traceback
 
     CleanUpStack(number_of_arguments);
     // Stack: (empty)
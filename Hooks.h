@@ -285,6 +285,7 @@ namespace Hooks
         CREATURE_EVENT_ON_DIALOG_STATUS                   = 35, // (event, player, creature)
         CREATURE_EVENT_ON_ADD                             = 36, // (event, creature)
         CREATURE_EVENT_ON_REMOVE                          = 37, // (event, creature)
+        CREATURE_EVENT_ON_AIUPDATE_BATCH                  = 38, // (event, creatures, diffs) - Entry only. Can return an array of true to stop normal action of the creatures on their next update, see RegisterCreatureEvent
         CREATURE_EVENT_COUNT
     };
 
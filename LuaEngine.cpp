@@ -12,6 +12,10 @@
 #include "ElunaTemplate.h"
 #include "ElunaUtility.h"
 #include "ElunaCreatureAI.h"
+#include "ElunaSharedData.h"
+#include "ElunaWorkerPool.h"
+#include <chrono>
+#include <cstring>
 
 #ifdef USING_BOOST
 #include <boost/filesystem.hpp>
@@ -38,32 +42,88 @@ Eluna* Eluna::GEluna = NULL;
 bool Eluna::reload = false;
 bool Eluna::initialized = false;
 Eluna::LockType Eluna::lock;
+bool Eluna::usemapstates = false;
+Eluna::MapStates Eluna::mapStates;
+ElunaUtil::RWLockable Eluna::mapStatesLock;
 
 extern void RegisterFunctions(Eluna* E);
 
+// Calls the event handlers of one hook so that the hook enters lua once, see DispatchFunctions.
+//   Arguments: traceback or nil, default_value, number_of_functions, update, [functions], [diffs if update], event_id, [arguments]
+//   Each handler is called in its own protected call, errors are reported and the rest of the handlers are still called.
+static const char* DispatcherSource =
+    "local report = ...\n"
+    "local select, type, pcall, xpcall, pack, unpack = select, type, pcall, xpcall, table.pack, table.unpack\n"
+    "return function(handler, default, n, update, ...)\n"
+    "    local result = default\n"
+    "    local args\n"
+    "    if update then\n"
+    "        args = pack(select(n + n + 1, ...))\n"
+    "    end\n"
+    "    for i = n, 1, -1 do\n"
+    "        local f = select(i, ...)\n"
+    "        local ok, r\n"
+    "        if update then\n"
+    "            args[args.n] = select(n + i, ...)\n"
+    "            if handler then\n"
+    "                ok, r = xpcall(f, handler, unpack(args, 1, args.n))\n"
+    "            else\n"
+    "                ok, r = pcall(f, unpack(args, 1, args.n))\n"
+    "            end\n"
+    "        elseif handler then\n"
+    "            ok, r = xpcall(f, handler, select(n + 1, ...))\n"
+    "        else\n"
+    "            ok, r = pcall(f, select(n + 1, ...))\n"
+    "        end\n"
+    "        if not ok then\n"
+    "            report(r)\n"
+    "        elseif type(r) == \"boolean\" and r ~= default then\n"
+    "            result = not default\n"
+    "        end\n"
+    "    end\n"
+    "    return result\n"
+    "end\n";
+
 void Eluna::Initialize()
 {
-    LOCK_ELUNA;
+    Guard guard(GetLock());
     ASSERT(!IsInitialized());
 
     LoadScriptPaths();
 
+    // Maps get their own lua states on creation, see OnCreate(Map*)
+    usemapstates = eConfigMgr->GetBoolDefault("Eluna.MapStates", false);
+    if (usemapstates)
+        ELUNA_LOG_INFO("[Eluna]: Map states enabled, scripts run once in the world state and once per map. Use GetStateMap() to tell them apart");
+
+    // The worker threads start on the first RunAsync
+    ElunaWorkerPool::Start(eConfigMgr->GetIntDefault("Eluna.AsyncWorkers", 2), eConfigMgr->GetIntDefault("Eluna.AsyncInstructionLimit", 100000000));
+
+    ElunaUtil::LockProfiler::SetEnabled(eConfigMgr->GetBoolDefault("Eluna.LockProfiling", false));
+
+    ElunaEventProcessor::SetBudget(eConfigMgr->GetIntDefault("Eluna.EventBudgetCount", 0), eConfigMgr->GetIntDefault("Eluna.EventBudgetMicroseconds", 0));
+
     // Must be before creating GEluna
     // This is checked on Eluna creation
     initialized = true;
 
     // Create global eluna
-    GEluna = new Eluna();
+    GEluna = new Eluna(NULL, &GEluna);
 }
 
 void Eluna::Uninitialize()
 {
-    LOCK_ELUNA;
+    Guard guard(GetLock());
     ASSERT(IsInitialized());
 
+    // The world state frees the timed events of all objects, map states must still exist
     delete GEluna;
     GEluna = NULL;
 
+    DestroyMapStates();
+
+    ElunaWorkerPool::Stop();
+
     lua_scripts.clear();
     lua_extensions.clear();
 
@@ -95,7 +155,7 @@ void Eluna::LoadScriptPaths()
 
 void Eluna::_ReloadEluna()
 {
-    LOCK_ELUNA;
+    Guard guard(GetLock());
     ASSERT(IsInitialized());
 
     eWorld->SendServerMessage(SERVER_MSG_STRING, "Reloading Eluna...");
@@ -115,6 +175,23 @@ void Eluna::_ReloadEluna()
     // Run scripts from laoded paths
     sEluna->RunScripts();
 
+    // Reload map states in place, creature AI and timed events keep pointers to them
+    {
+        ElunaUtil::RWLockable::ReadGuard mapGuard(mapStatesLock.GetLock());
+        for (MapStates::const_iterator it = mapStates.begin(); it != mapStates.end(); ++it)
+        {
+            Eluna* state = it->second;
+            if (!state)
+                continue;
+
+            Guard stateGuard(state->GetStateLock());
+            state->eventMgr->RemoveEvents();
+            state->CloseLua();
+            state->OpenLua();
+            state->RunScripts();
+        }
+    }
+
 #ifdef TRINITY
     // Re initialize creature AI restoring C++ AI or applying lua AI
     {
@@ -128,13 +205,31 @@ void Eluna::_ReloadEluna()
     reload = false;
 }
 
-Eluna::Eluna() :
+Eluna::Eluna(Map* map, Eluna** self) :
 event_level(0),
+callstackid(1),
 push_counter(0),
 enabled(false),
+usetrace(false),
+coroutineTime(0),
+coroutinePass(0),
+runningCoroutine(NULL),
+jobInstructions(0),
+jobMicroseconds(0),
+ownerMap(map),
+stateLock(map ? &ownLock : &lock),
 
 L(NULL),
 eventMgr(NULL),
+bindGeneration(0),
+userdata_table(LUA_NOREF),
+dispatcher(LUA_NOREF),
+int64_table(LUA_NOREF),
+uint64_table(LUA_NOREF),
+deferredEvents(NULL),
+updateContext(NULL),
+objectStoreHits(0),
+objectStoreMisses(0),
 
 ServerEventBindings(NULL),
 PlayerEventBindings(NULL),
@@ -143,6 +238,9 @@ GroupEventBindings(NULL),
 VehicleEventBindings(NULL),
 BGEventBindings(NULL),
 
+PlayerDeferredBindings(NULL),
+GuildDeferredBindings(NULL),
+
 PacketEventBindings(NULL),
 CreatureEventBindings(NULL),
 CreatureGossipBindings(NULL),
@@ -158,18 +256,22 @@ CreatureUniqueBindings(NULL)
 
     OpenLua();
 
-    // Replace this with map insert if making multithread version
-    //
-
-    // Set event manager. Must be after setting sEluna
-    // on multithread have a map of state pointers and here insert this pointer to the map and then save a pointer of that pointer to the EventMgr
-    eventMgr = new EventMgr(&Eluna::GEluna);
+    // Set event manager. self is the slot this state is stored in, sEluna or a mapStates entry
+    eventMgr = new EventMgr(self);
 }
 
 Eluna::~Eluna()
 {
     CloseLua();
 
+    DeferredEvent* deferred = deferredEvents.exchange(NULL);
+    while (deferred)
+    {
+        DeferredEvent* next = deferred->next;
+        delete deferred;
+        deferred = next;
+    }
+
     delete eventMgr;
     eventMgr = NULL;
 }
@@ -178,6 +280,15 @@ void Eluna::CloseLua()
 {
     OnLuaStateClose();
 
+    // Results of jobs still running are discarded
+    if (asyncResults)
+        asyncResults->Close();
+    asyncResults.reset();
+
+    // Waiting coroutines and cron event references are collected with the lua state
+    coroutines.clear();
+    cronEvents.Clear();
+
     DestroyBindStores();
 
     // Must close lua state after deleting stores and mgr
@@ -197,7 +308,16 @@ void Eluna::OpenLua()
         return;
     }
 
-    L = luaL_newstate();
+    // Use our own allocator so the owning Eluna can be fetched from any lua_State, see GetEluna
+    L = lua_newstate(&Alloc, this);
+    lua_atpanic(L, &AtPanic);
+
+    asyncResults.reset(new ElunaAsyncResults());
+
+    // Read once here instead of on every call, config changes are applied on reload
+    usetrace = eConfigMgr->GetBoolDefault("Eluna.TraceBack", false);
+    jobInstructions = eConfigMgr->GetIntDefault("Eluna.JobInstructions", 100000);
+    jobMicroseconds = eConfigMgr->GetIntDefault("Eluna.JobMicroseconds", 2000);
 
     // open base lua libraries
     luaL_openlibs(L);
@@ -213,7 +333,30 @@ void Eluna::OpenLua()
     lua_pushstring(L, "v");
     lua_setfield(L, -2, "__mode");
     lua_setmetatable(L, -2);
-    lua_setglobal(L, ELUNA_OBJECT_STORE);
+    userdata_table = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // Load the dispatcher before any script can replace the globals it uses
+    if (luaL_loadbuffer(L, DispatcherSource, strlen(DispatcherSource), "=dispatcher"))
+        Report(L);
+    else
+    {
+        lua_pushcfunction(L, &ReportError);
+        if (ExecuteCall(1, 1))
+            dispatcher = luaL_ref(L, LUA_REGISTRYINDEX);
+        else
+            lua_pop(L, 1);
+    }
+
+    // Create hidden tables with weak values for interning 64 bit integers
+    for (int i = 0; i < 2; ++i)
+    {
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushstring(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        (i ? uint64_table : int64_table) = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
 
     // Set lua require folder paths (scripts folder structure)
     lua_getglobal(L, "package");
@@ -235,6 +378,9 @@ void Eluna::CreateBindStores()
     VehicleEventBindings = new EventBind<Hooks::VehicleEvents>("VehicleEvents", *this);
     BGEventBindings = new EventBind<Hooks::BGEvents>("BGEvents", *this);
 
+    PlayerDeferredBindings = new EventBind<Hooks::PlayerEvents>("PlayerEvents (deferred)", *this);
+    GuildDeferredBindings = new EventBind<Hooks::GuildEvents>("GuildEvents (deferred)", *this);
+
     PacketEventBindings = new EntryBind<Hooks::PacketEvents>("PacketEvents", *this);
     CreatureEventBindings = new EntryBind<Hooks::CreatureEvents>("CreatureEvents", *this);
     CreatureGossipBindings = new EntryBind<Hooks::GossipEvents>("GossipEvents (creature)", *this);
@@ -245,6 +391,9 @@ void Eluna::CreateBindStores()
     playerGossipBindings = new EntryBind<Hooks::GossipEvents>("GossipEvents (player)", *this);
 
     CreatureUniqueBindings = new UniqueBind<Hooks::CreatureEvents>("CreatureEvents (unique)", *this);
+
+    // The bindings were replaced
+    bindGeneration.fetch_add(1, std::memory_order_relaxed);
 }
 
 void Eluna::DestroyBindStores()
@@ -255,6 +404,9 @@ void Eluna::DestroyBindStores()
     delete GroupEventBindings;
     delete VehicleEventBindings;
 
+    delete PlayerDeferredBindings;
+    delete GuildDeferredBindings;
+
     delete PacketEventBindings;
     delete CreatureEventBindings;
     delete CreatureGossipBindings;
@@ -273,6 +425,9 @@ void Eluna::DestroyBindStores()
     GroupEventBindings = NULL;
     VehicleEventBindings = NULL;
 
+    PlayerDeferredBindings = NULL;
+    GuildDeferredBindings = NULL;
+
     PacketEventBindings = NULL;
     CreatureEventBindings = NULL;
     CreatureGossipBindings = NULL;
@@ -499,17 +654,9 @@ void Eluna::RunScripts()
 
 void Eluna::InvalidateObjects()
 {
-    lua_getglobal(L, ELUNA_OBJECT_STORE);
-    ASSERT(lua_istable(L, -1));
-
-    lua_pushnil(L);
-    while (lua_next(L, -2))
-    {
-        if (ElunaObject* elunaObj = CHECKOBJ<ElunaObject>(L, -1, false))
-            elunaObj->Invalidate();
-        lua_pop(L, 1);
-    }
-    lua_pop(L, 1);
+    // Starting a new call stack id invalidates all objects pushed in the previous one
+    // without having to go through the object store
+    ++callstackid;
 }
 
 void Eluna::Report(lua_State* _L)
@@ -519,6 +666,39 @@ void Eluna::Report(lua_State* _L)
     lua_pop(_L, 1);
 }
 
+int Eluna::ReportError(lua_State* _L)
+{
+    // Stack: errmsg
+    Report(_L);
+
+    // Force garbage collect, like ExecuteCall does on errors
+    lua_gc(_L, LUA_GCCOLLECT, 0);
+    return 0;
+}
+
+int Eluna::AtPanic(lua_State* _L)
+{
+    ELUNA_LOG_ERROR("[Eluna]: PANIC: unprotected error in call to Lua API (%s)", lua_tostring(_L, -1));
+    return 0;
+}
+
+void* Eluna::Alloc(void* /*ud*/, void* ptr, size_t /*osize*/, size_t nsize)
+{
+    if (nsize == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+Eluna* Eluna::GetEluna(lua_State* luastate)
+{
+    void* ud = NULL;
+    lua_getallocf(luastate, &ud);
+    return static_cast<Eluna*>(ud);
+}
+
 // Borrowed from http://stackoverflow.com/questions/12256455/print-stacktrace-from-c-code-with-embedded-lua
 int Eluna::StackTrace(lua_State *_L)
 {
@@ -549,7 +729,7 @@ int Eluna::StackTrace(lua_State *_L)
     return 1;
 }
 
-bool Eluna::ExecuteCall(int params, int res)
+bool Eluna::ExecuteCall(int params, int res, int traceback)
 {
     int top = lua_gettop(L);
     int base = top - params;
@@ -564,21 +744,23 @@ bool Eluna::ExecuteCall(int params, int res)
         ASSERT(false); // stack probably corrupt
     }
 
-    bool usetrace = eConfigMgr->GetBoolDefault("Eluna.TraceBack", false);
-    if (usetrace)
+    // Push our own traceback handler if the caller did not push one for us
+    bool pushtrace = usetrace && !traceback;
+    if (pushtrace)
     {
         lua_pushcfunction(L, &StackTrace);
         // Stack: function, [parameters], traceback
         lua_insert(L, base);
         // Stack: traceback, function, [parameters]
+        traceback = base;
     }
 
     // Objects are invalidated when event_level hits 0
     ++event_level;
-    int result = lua_pcall(L, params, res, usetrace ? base : 0);
+    int result = lua_pcall(L, params, res, usetrace ? traceback : 0);
     --event_level;
 
-    if (usetrace)
+    if (pushtrace)
     {
         // Stack: traceback, [results or errmsg]
         lua_remove(L, base);
@@ -610,13 +792,59 @@ void Eluna::Push(lua_State* luastate)
 {
     lua_pushnil(luastate);
 }
+// 64 bit integers are stored in the same userdata block as the ElunaObject that points to them
+template<typename T>
+struct ElunaInt64
+{
+    ElunaObject object;
+    T value;
+};
+
+template<typename T>
+static void PushInt64Key(lua_State* luastate, T l)
+{
+    // Light userdata keys need no allocation, but pointers may be too small to hold the value
+    if (sizeof(void*) >= sizeof(T))
+        lua_pushlightuserdata(luastate, reinterpret_cast<void*>(static_cast<uintptr_t>(l)));
+    else
+        lua_pushlstring(luastate, reinterpret_cast<const char*>(&l), sizeof(T));
+}
+
+// Pushes an interned 64 bit integer so that equal values are the same userdata
+// and can be compared with == and used as table keys
+template<typename T>
+static void PushInt64(lua_State* luastate, T l, int internTable)
+{
+    lua_rawgeti(luastate, LUA_REGISTRYINDEX, internTable);
+    PushInt64Key(luastate, l);
+    lua_rawget(luastate, -2);
+    if (!lua_isnil(luastate, -1))
+    {
+        // remove intern table, leave userdata
+        lua_remove(luastate, -2);
+        return;
+    }
+    lua_pop(luastate, 1);
+
+    ElunaInt64<T>* ud = static_cast<ElunaInt64<T>*>(lua_newuserdata(luastate, sizeof(ElunaInt64<T>)));
+    ud->value = l;
+    new (&ud->object) ElunaObject(Eluna::GetEluna(luastate), &ud->value, ElunaTemplate<T>::typeId, ElunaTemplate<T>::typeMask, true);
+    luaL_getmetatable(luastate, ElunaTemplate<T>::tname);
+    lua_setmetatable(luastate, -2);
+
+    PushInt64Key(luastate, l);
+    lua_pushvalue(luastate, -2);
+    lua_rawset(luastate, -4);
+    lua_remove(luastate, -2);
+}
+
 void Eluna::Push(lua_State* luastate, const long long l)
 {
-    ElunaTemplate<long long>::Push(luastate, new long long(l));
+    PushInt64(luastate, l, GetEluna(luastate)->int64_table);
 }
 void Eluna::Push(lua_State* luastate, const unsigned long long l)
 {
-    ElunaTemplate<unsigned long long>::Push(luastate, new unsigned long long(l));
+    PushInt64(luastate, l, GetEluna(luastate)->uint64_table);
 }
 void Eluna::Push(lua_State* luastate, const long l)
 {
@@ -834,66 +1062,75 @@ template<> unsigned long Eluna::CHECKVAL<unsigned long>(lua_State* luastate, int
     return static_cast<unsigned long>(CHECKVAL<unsigned long long>(luastate, narg));
 }
 
+// Objects of derived types are accepted by the type mask check of the base type.
+// The wrapped pointer is cast from the exact type of the object so that pointer adjustments are done.
+static Unit* ToUnit(ElunaObject* elunaObj)
+{
+    if (elunaObj->GetTypeId() == ElunaTemplate<Player>::typeId)
+        return static_cast<Player*>(elunaObj->GetObj());
+    if (elunaObj->GetTypeId() == ElunaTemplate<Creature>::typeId)
+        return static_cast<Creature*>(elunaObj->GetObj());
+    return static_cast<Unit*>(elunaObj->GetObj());
+}
+static WorldObject* ToWorldObject(ElunaObject* elunaObj)
+{
+    if (elunaObj->GetTypeMask() & (uint64(1) << ElunaTemplate<Unit>::typeId))
+        return ToUnit(elunaObj);
+    if (elunaObj->GetTypeId() == ElunaTemplate<GameObject>::typeId)
+        return static_cast<GameObject*>(elunaObj->GetObj());
+    if (elunaObj->GetTypeId() == ElunaTemplate<Corpse>::typeId)
+        return static_cast<Corpse*>(elunaObj->GetObj());
+    return static_cast<WorldObject*>(elunaObj->GetObj());
+}
+static Object* ToObject(ElunaObject* elunaObj)
+{
+    if (elunaObj->GetTypeMask() & (uint64(1) << ElunaTemplate<WorldObject>::typeId))
+        return ToWorldObject(elunaObj);
+    if (elunaObj->GetTypeId() == ElunaTemplate<Item>::typeId)
+        return static_cast<Item*>(elunaObj->GetObj());
+    return static_cast<Object*>(elunaObj->GetObj());
+}
+
 template<> Object* Eluna::CHECKOBJ<Object>(lua_State* luastate, int narg, bool error)
 {
-    Object* obj = CHECKOBJ<WorldObject>(luastate, narg, false);
-    if (!obj)
-        obj = CHECKOBJ<Item>(luastate, narg, false);
-    if (!obj)
-        obj = ElunaTemplate<Object>::Check(luastate, narg, error);
-    return obj;
+    ElunaObject* elunaObj = ElunaTemplate<Object>::CheckObject(luastate, narg, error);
+    return elunaObj ? ToObject(elunaObj) : NULL;
 }
 template<> WorldObject* Eluna::CHECKOBJ<WorldObject>(lua_State* luastate, int narg, bool error)
 {
-    WorldObject* obj = CHECKOBJ<Unit>(luastate, narg, false);
-    if (!obj)
-        obj = CHECKOBJ<GameObject>(luastate, narg, false);
-    if (!obj)
-        obj = CHECKOBJ<Corpse>(luastate, narg, false);
-    if (!obj)
-        obj = ElunaTemplate<WorldObject>::Check(luastate, narg, error);
-    return obj;
+    ElunaObject* elunaObj = ElunaTemplate<WorldObject>::CheckObject(luastate, narg, error);
+    return elunaObj ? ToWorldObject(elunaObj) : NULL;
 }
 template<> Unit* Eluna::CHECKOBJ<Unit>(lua_State* luastate, int narg, bool error)
 {
-    Unit* obj = CHECKOBJ<Player>(luastate, narg, false);
-    if (!obj)
-        obj = CHECKOBJ<Creature>(luastate, narg, false);
-    if (!obj)
-        obj = ElunaTemplate<Unit>::Check(luastate, narg, error);
-    return obj;
+    ElunaObject* elunaObj = ElunaTemplate<Unit>::CheckObject(luastate, narg, error);
+    return elunaObj ? ToUnit(elunaObj) : NULL;
 }
 
 template<> ElunaObject* Eluna::CHECKOBJ<ElunaObject>(lua_State* luastate, int narg, bool error)
 {
-    return CHECKTYPE(luastate, narg, NULL, error);
+    return CHECKTYPE(luastate, narg, NULL, 0, error);
 }
 
-ElunaObject* Eluna::CHECKTYPE(lua_State* luastate, int narg, const char* tname, bool error)
+ElunaObject* Eluna::CHECKTYPE(lua_State* luastate, int narg, const char* tname, uint64 typeMask, bool error)
 {
-    bool valid = false;
-    ElunaObject** ptrHold = NULL;
+    ElunaObject* elunaObj = NULL;
 
-    if (!tname)
+    // Eluna userdata are recognized by their size and the tag at their start, then by owner and type mask.
+    // This avoids metatable lookups from the registry.
+    // The block can be larger than ElunaObject when the wrapped value is stored in it, see PushInt64.
+    if (lua_type(luastate, narg) == LUA_TUSERDATA && lua_rawlen(luastate, narg) >= sizeof(ElunaObject))
     {
-        valid = true;
-        ptrHold = static_cast<ElunaObject**>(lua_touserdata(luastate, narg));
-    }
-    else
-    {
-        if (lua_getmetatable(luastate, narg))
+        void* memory = lua_touserdata(luastate, narg);
+        if (ElunaObject::IsElunaObject(memory))
         {
-            luaL_getmetatable(luastate, tname);
-            if (lua_rawequal(luastate, -1, -2) == 1)
-            {
-                valid = true;
-                ptrHold = static_cast<ElunaObject**>(lua_touserdata(luastate, narg));
-            }
-            lua_pop(luastate, 2);
+            elunaObj = static_cast<ElunaObject*>(memory);
+            if (elunaObj->GetEluna() != GetEluna(luastate) || (elunaObj->GetTypeMask() & typeMask) != typeMask)
+                elunaObj = NULL;
         }
     }
 
-    if (!valid || !ptrHold)
+    if (!elunaObj)
     {
         if (error)
         {
@@ -903,18 +1140,71 @@ ElunaObject* Eluna::CHECKTYPE(lua_State* luastate, int narg, const char* tname,
         }
         return NULL;
     }
-    return *ptrHold;
+    return elunaObj;
+}
+
+// Events whose hooks record their calls for deferred handlers
+static bool IsDeferrable(uint8 regtype, uint32 evt)
+{
+    switch (regtype)
+    {
+        case Hooks::REGTYPE_PLAYER:
+            return evt == Hooks::PLAYER_EVENT_ON_LOOT_ITEM || evt == Hooks::PLAYER_EVENT_ON_KILL_PLAYER ||
+                evt == Hooks::PLAYER_EVENT_ON_KILL_CREATURE || evt == Hooks::PLAYER_EVENT_ON_LEVEL_CHANGE;
+        case Hooks::REGTYPE_GUILD:
+            return evt == Hooks::GUILD_EVENT_ON_ADD_MEMBER || evt == Hooks::GUILD_EVENT_ON_BANK_EVENT;
+        default:
+            return false;
+    }
+}
+
+static bool IsIntervalEvent(uint8 regtype, uint32 evt)
+{
+    switch (regtype)
+    {
+        case Hooks::REGTYPE_SERVER:
+            return evt == Hooks::WORLD_EVENT_ON_UPDATE || evt == Hooks::MAP_EVENT_ON_UPDATE;
+        case Hooks::REGTYPE_CREATURE:
+            return evt == Hooks::CREATURE_EVENT_ON_AIUPDATE;
+        case Hooks::REGTYPE_GAMEOBJECT:
+            return evt == Hooks::GAMEOBJECT_EVENT_ON_AIUPDATE;
+        default:
+            return false;
+    }
 }
 
 // Saves the function reference ID given to the register type's store for given entry under the given event
-void Eluna::Register(uint8 regtype, uint32 id, uint64 guid, uint32 instanceId, uint32 evt, int functionRef, uint32 shots)
+void Eluna::Register(uint8 regtype, uint32 id, uint64 guid, uint32 instanceId, uint32 evt, int functionRef, uint32 shots, bool deferred, uint32 interval)
 {
+    if (interval && !IsIntervalEvent(regtype, evt))
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, functionRef);
+        luaL_error(L, "Event can not have an interval (regtype %d, event %d)", regtype, evt);
+        return;
+    }
+
+    if (deferred)
+    {
+        if (!IsDeferrable(regtype, evt))
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, functionRef);
+            luaL_error(L, "Event can not be deferred (regtype %d, event %d)", regtype, evt);
+            return;
+        }
+
+        if (regtype == Hooks::REGTYPE_PLAYER)
+            PlayerDeferredBindings->Insert(evt, functionRef, shots);
+        else
+            GuildDeferredBindings->Insert(evt, functionRef, shots);
+        return;
+    }
+
     switch (regtype)
     {
         case Hooks::REGTYPE_SERVER:
             if (evt < Hooks::SERVER_EVENT_COUNT)
             {
-                ServerEventBindings->Insert(evt, functionRef, shots);
+                ServerEventBindings->Insert(evt, functionRef, shots, interval);
                 return;
             }
             break;
@@ -986,12 +1276,20 @@ void Eluna::Register(uint8 regtype, uint32 id, uint64 guid, uint32 instanceId, u
                         return;
                     }
 
-                    CreatureEventBindings->Insert(id, evt, functionRef, shots);
+                    CreatureEventBindings->Insert(id, evt, functionRef, shots, interval);
                 }
                 else
                 {
                     ASSERT(guid != 0);
-                    CreatureUniqueBindings->Insert(guid, instanceId, evt, functionRef, shots);
+                    // Batches are called per entry
+                    if (evt == Hooks::CREATURE_EVENT_ON_AIUPDATE_BATCH)
+                    {
+                        luaL_unref(L, LUA_REGISTRYINDEX, functionRef);
+                        luaL_error(L, "Event can only be registered for an entry (regtype %d, event %d)", regtype, evt);
+                        return;
+                    }
+
+                    CreatureUniqueBindings->Insert(guid, instanceId, evt, functionRef, shots, interval);
                 }
                 return;
             }
@@ -1022,7 +1320,7 @@ void Eluna::Register(uint8 regtype, uint32 id, uint64 guid, uint32 instanceId, u
                     return;
                 }
 
-                GameObjectEventBindings->Insert(id, evt, functionRef, shots);
+                GameObjectEventBindings->Insert(id, evt, functionRef, shots, interval);
                 return;
             }
             break;
@@ -1084,14 +1382,295 @@ void Eluna::Register(uint8 regtype, uint32 id, uint64 guid, uint32 instanceId, u
     luaL_error(L, "Unknown event type (regtype %d, id %d, event %d)", regtype, id, evt);
 }
 
+void Eluna::ProcessAsyncResults()
+{
+    if (!asyncResults)
+        return;
+
+    std::vector<ElunaAsyncJob*> jobs;
+    asyncResults->TakeAll(jobs);
+    if (jobs.empty())
+        return;
+
+    LOCK_ELUNA;
+    ASSERT(!event_level);
+
+    for (std::vector<ElunaAsyncJob*>::const_iterator it = jobs.begin(); it != jobs.end(); ++it)
+    {
+        ElunaAsyncJob* job = *it;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job->callback);
+        luaL_unref(L, LUA_REGISTRYINDEX, job->callback);
+
+        // callback(true, results...) or callback(false, error)
+        Push(L, job->success);
+        int params = 1;
+        if (job->success)
+        {
+            ElunaSharedData::Deserialize(L, job->results);
+            int results = lua_gettop(L);
+            for (uint32 i = 1; i <= job->resultCount; ++i)
+                lua_rawgeti(L, results, i);
+            lua_remove(L, results);
+            params += job->resultCount;
+        }
+        else
+        {
+            Push(L, job->results);
+            ++params;
+        }
+
+        ExecuteCall(params, 0);
+        delete job;
+    }
+
+    ASSERT(!event_level);
+    InvalidateObjects();
+}
+
+// Instructions between job hook calls
+static const int JOB_HOOK_COUNT = 1000;
+
+static uint64 JobNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Eluna::JobHook(lua_State* _L, lua_Debug* /*ar*/)
+{
+    // Threads created by the job inherit the hook, only the job itself yields
+    Eluna* E = GetEluna(_L);
+    Coroutine* co = E->runningCoroutine;
+    if (!co || !co->job || co->thread != _L)
+        return;
+
+    co->sliceInstructions += JOB_HOOK_COUNT;
+    if (co->sliceInstructions < E->jobInstructions && JobNow() - co->sliceStart < E->jobMicroseconds)
+        return;
+
+    // Yielding across a C function would error, such as a table.sort comparator or a hook called by a method.
+    // Keep running until a later hook call is outside of them
+    lua_Debug frame;
+    for (int level = 0; lua_getstack(_L, level, &frame); ++level)
+    {
+        lua_getinfo(_L, "S", &frame);
+        if (!strcmp(frame.what, "C"))
+            return;
+    }
+
+    lua_yield(_L, 0);
+}
+
+void Eluna::StartCoroutine(lua_State* from, int args, bool job)
+{
+    // Stack: function, [arguments]
+    Coroutine co;
+    co.thread = lua_newthread(from);
+    co.threadRef = luaL_ref(from, LUA_REGISTRYINDEX);
+    lua_xmove(from, co.thread, args + 1);
+
+    co.job = job;
+    if (job)
+        lua_sethook(co.thread, &JobHook, LUA_MASKCOUNT, JOB_HOOK_COUNT);
+
+    ResumeCoroutine(co, from, args);
+}
+
+bool Eluna::WaitCoroutine(lua_State* thread, Coroutine::WaitType wait, uint32 timeout, int predicateRef, const char* event)
+{
+    if (!runningCoroutine || runningCoroutine->thread != thread)
+        return false;
+
+    runningCoroutine->wait = wait;
+    runningCoroutine->wakeTime = timeout ? coroutineTime + timeout : 0;
+    runningCoroutine->predicateRef = predicateRef;
+    if (event)
+        runningCoroutine->event = event;
+    return true;
+}
+
+void Eluna::SignalCoroutines(lua_State* from, const char* event, int index)
+{
+    int top = lua_gettop(from);
+    for (std::vector<Coroutine>::iterator it = coroutines.begin(); it != coroutines.end(); ++it)
+    {
+        if (it->wait != Coroutine::WAIT_EVENT || it->event != event)
+            continue;
+
+        // Stack of the thread: true, [arguments]
+        lua_pushboolean(it->thread, 1);
+        for (int i = index; i <= top; ++i)
+        {
+            lua_pushvalue(from, i);
+            lua_xmove(from, it->thread, 1);
+        }
+        it->wait = Coroutine::WAIT_READY;
+        it->args = top - index + 2;
+    }
+}
+
+void Eluna::ResumeCoroutine(Coroutine co, lua_State* from, int args)
+{
+    // A coroutine that yields without a Wait function is resumed on the next update
+    co.wait = Coroutine::WAIT_TIME;
+    co.wakeTime = coroutineTime;
+    co.predicateRef = 0;
+    co.event.clear();
+    co.pass = coroutinePass;
+
+    if (co.job)
+    {
+        co.sliceStart = JobNow();
+        co.sliceInstructions = 0;
+    }
+
+    Coroutine* previous = runningCoroutine;
+    runningCoroutine = &co;
+    ++event_level;
+    int status = lua_resume(co.thread, from, args);
+    --event_level;
+    runningCoroutine = previous;
+
+    if (status == LUA_YIELD)
+    {
+        // Yielded values are not used
+        lua_settop(co.thread, 0);
+        coroutines.push_back(co);
+        return;
+    }
+
+    if (status != LUA_OK)
+    {
+        // Stack of the thread: errmsg
+        if (usetrace)
+        {
+            luaL_traceback(co.thread, co.thread, lua_tostring(co.thread, -1), 0);
+            lua_remove(co.thread, -2);
+        }
+        Report(co.thread);
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, co.threadRef);
+}
+
+bool Eluna::IsCoroutineDue(uint32 index, int& args)
+{
+    Coroutine& co = coroutines[index];
+    bool timedOut = co.wakeTime && co.wakeTime <= coroutineTime;
+    args = 0;
+
+    switch (co.wait)
+    {
+        case Coroutine::WAIT_READY:
+            args = co.args;
+            return true;
+        case Coroutine::WAIT_TIME:
+            return co.wakeTime <= coroutineTime;
+        case Coroutine::WAIT_EVENT:
+            if (!timedOut)
+                return false;
+            lua_pushboolean(co.thread, 0);
+            args = 1;
+            return true;
+        case Coroutine::WAIT_UNTIL:
+        {
+            // The predicate may start coroutines, which can move co in the vector
+            int predicateRef = co.predicateRef;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, predicateRef);
+            bool success = ExecuteCall(0, 1);
+            bool done = success && lua_toboolean(L, -1);
+            lua_pop(L, 1);
+
+            // A failing predicate ends the wait like a timeout
+            if (!done && success && !timedOut)
+                return false;
+
+            luaL_unref(L, LUA_REGISTRYINDEX, predicateRef);
+            lua_pushboolean(coroutines[index].thread, done);
+            args = 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Eluna::ProcessCoroutines(uint32 diff)
+{
+    coroutineTime += diff;
+    if (coroutines.empty())
+        return;
+
+    LOCK_ELUNA;
+    ASSERT(!event_level);
+
+    // Coroutines that wait again while processing get the new pass and are left for the next update
+    ++coroutinePass;
+    for (uint32 i = 0; i < coroutines.size();)
+    {
+        int args = 0;
+        if (coroutines[i].pass == coroutinePass || !IsCoroutineDue(i, args))
+        {
+            ++i;
+            continue;
+        }
+
+        Coroutine co = coroutines[i];
+        coroutines[i] = coroutines.back();
+        coroutines.pop_back();
+        ResumeCoroutine(co, L, args);
+    }
+
+    ASSERT(!event_level);
+    InvalidateObjects();
+}
+
+void Eluna::ProcessCronEvents()
+{
+    time_t now = time(NULL);
+    if (!cronEvents.MayBeDue(now))
+        return;
+
+    LOCK_ELUNA;
+    if (!cronEvents.IsDue(now))
+        return;
+
+    ASSERT(!event_level);
+
+    int funcRef;
+    bool expired;
+    while (cronEvents.PopDue(now, funcRef, expired))
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, funcRef);
+        if (expired)
+            luaL_unref(L, LUA_REGISTRYINDEX, funcRef);
+
+        // function(eventId, time)
+        Push(L, funcRef);
+        Push(L, uint32(now));
+        ExecuteCall(2, 0);
+    }
+
+    ASSERT(!event_level);
+    InvalidateObjects();
+}
+
+void Eluna::Defer(DeferredEvent* deferred)
+{
+    DeferredEvent* head = deferredEvents.load(std::memory_order_relaxed);
+    do
+    {
+        deferred->next = head;
+    } while (!deferredEvents.compare_exchange_weak(head, deferred, std::memory_order_release, std::memory_order_relaxed));
+}
+
 /*
  * Cleans up the stack, effectively undoing all Push calls and the Setup call.
  */
 void Eluna::CleanUpStack(int number_of_arguments)
 {
-    // Stack: event_id, [arguments]
+    // Stack: event_id, [arguments], traceback
 
-    lua_pop(L, number_of_arguments + 1); // Add 1 because the caller doesn't know about `event_id`.
+    lua_pop(L, number_of_arguments + 1 + (usetrace ? 1 : 0)); // Add 1 because the caller doesn't know about `event_id`.
     // Stack: (empty)
 
     if (event_level == 0)
@@ -1107,11 +1686,12 @@ int Eluna::CallOneFunction(int number_of_functions, int number_of_arguments, int
 {
     ++number_of_arguments; // Caller doesn't know about `event_id`.
     ASSERT(number_of_functions > 0 && number_of_arguments > 0 && number_of_results >= 0);
-    // Stack: event_id, [arguments], [functions]
+    // Stack: event_id, [arguments], traceback, [functions]
 
     int functions_top        = lua_gettop(L);
     int first_function_index = functions_top - number_of_functions + 1;
-    int arguments_top        = first_function_index - 1;
+    int traceback_index      = usetrace ? first_function_index - 1 : 0;
+    int arguments_top        = first_function_index - 1 - (usetrace ? 1 : 0);
     int first_argument_index = arguments_top - number_of_arguments + 1;
 
     // Copy the arguments from the bottom of the stack to the top.
@@ -1119,20 +1699,156 @@ int Eluna::CallOneFunction(int number_of_functions, int number_of_arguments, int
     {
         lua_pushvalue(L, argument_index);
     }
-    // Stack: event_id, [arguments], [functions], event_id, [arguments]
+    // Stack: event_id, [arguments], traceback, [functions], event_id, [arguments]
 
-    ExecuteCall(number_of_arguments, number_of_results);
+    // The traceback pushed once in SetupStack is shared by all the functions called
+    ExecuteCall(number_of_arguments, number_of_results, traceback_index);
     --functions_top;
-    // Stack: event_id, [arguments], [functions - 1], [results]
+    // Stack: event_id, [arguments], traceback, [functions - 1], [results]
 
     return functions_top + 1; // Return the location of the first result (if any exist).
 }
 
+/*
+ * Call all event handlers that were put on the stack with `Setup` with one call to the dispatcher and removes them from the stack.
+ *
+ * If `diffs` is not NULL the last argument is replaced with the diff of each function, see CallAllUpdateFunctions.
+ * `result` is set like CallAllFunctionsBool sets its return value.
+ * Returns false without touching the stack if the dispatcher can not be used, the caller must then call the functions with `CallOneFunction`.
+ */
+bool Eluna::DispatchFunctions(int number_of_functions, int number_of_arguments, bool default_value, const std::vector<uint32>* diffs, bool& result)
+{
+    result = default_value;
+    if (number_of_functions <= 0)
+        return true;
+
+    ++number_of_arguments; // Caller doesn't know about `event_id`.
+    ASSERT(number_of_arguments > 0);
+    ASSERT(!diffs || diffs->size() == size_t(number_of_functions));
+    // Stack: event_id, [arguments], traceback, [functions]
+
+    int number_of_params = 4 + number_of_functions * (diffs ? 2 : 1) + number_of_arguments;
+    if (dispatcher == LUA_NOREF || !lua_checkstack(L, number_of_params + 1))
+        return false;
+
+    int functions_top        = lua_gettop(L);
+    int first_function_index = functions_top - number_of_functions + 1;
+    int traceback_index      = usetrace ? first_function_index - 1 : 0;
+    int arguments_top        = first_function_index - 1 - (usetrace ? 1 : 0);
+    int first_argument_index = arguments_top - number_of_arguments + 1;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dispatcher);
+    if (usetrace)
+        lua_pushvalue(L, traceback_index);
+    else
+        lua_pushnil(L);
+    Push(L, default_value);
+    Push(L, number_of_functions);
+    Push(L, diffs != NULL);
+    // Stack: event_id, [arguments], traceback, [functions], dispatcher, traceback, default_value, number_of_functions, update
+
+    for (int function_index = first_function_index; function_index <= functions_top; ++function_index)
+        lua_pushvalue(L, function_index);
+
+    if (diffs)
+    {
+        for (std::vector<uint32>::const_iterator it = diffs->begin(); it != diffs->end(); ++it)
+            Push(L, *it);
+    }
+
+    for (int argument_index = first_argument_index; argument_index <= arguments_top; ++argument_index)
+        lua_pushvalue(L, argument_index);
+    // Stack: event_id, [arguments], traceback, [functions], dispatcher, traceback, default_value, number_of_functions, update, [functions], [diffs], event_id, [arguments]
+
+    // The handlers report their own errors, a result is only missing if the dispatcher itself failed
+    ExecuteCall(number_of_params, 1, traceback_index);
+    // Stack: event_id, [arguments], traceback, [functions], result
+
+    if (lua_isboolean(L, -1))
+        result = lua_toboolean(L, -1) == 1;
+
+    lua_pop(L, 1 + number_of_functions);
+    // Stack: event_id, [arguments], traceback
+    return true;
+}
+
 CreatureAI* Eluna::GetAI(Creature* creature)
 {
-    if (CreatureEventBindings->HasEvents(creature->GetEntry()) ||
-        CreatureUniqueBindings->HasEvents(creature->GET_GUID(), creature->GetInstanceId()))
-        return new ElunaCreatureAI(creature);
+    Eluna* E = GetMapState(creature->GetMap());
+    if (E->GetCreatureEventMask(creature))
+        return new ElunaCreatureAI(creature, E);
 
     return NULL;
 }
+
+uint64 Eluna::GetCreatureEventMask(Creature* creature)
+{
+    if (!IsEnabled())
+        return 0;
+
+    return CreatureEventBindings->GetEventMask(creature->GetEntry()) |
+        CreatureUniqueBindings->GetEventMask(creature->GET_GUID(), creature->GetInstanceId());
+}
+
+Eluna* Eluna::GetMapState(Map* map)
+{
+    if (!usemapstates || ownerMap || !map)
+        return this;
+
+    ElunaUtil::RWLockable::ReadGuard guard(mapStatesLock.GetLock());
+    MapStates::const_iterator it = mapStates.find(map);
+    if (it == mapStates.end() || !it->second)
+        return this;
+    return it->second;
+}
+
+void Eluna::CreateMapState(Map* map)
+{
+    if (!usemapstates || ownerMap)
+        return;
+
+    // Reserve the slot first, its address is given to the state's EventMgr.
+    // Hooks are dispatched in the world state until the scripts of the new state have been run.
+    Eluna** slot;
+    {
+        ElunaUtil::RWLockable::WriteGuard guard(mapStatesLock.GetLock());
+        MapStates::iterator it = mapStates.find(map);
+        if (it != mapStates.end())
+            return;
+        slot = &mapStates[map];
+    }
+
+    Eluna* state = new Eluna(map, slot);
+    state->RunScripts();
+
+    ElunaUtil::RWLockable::WriteGuard guard(mapStatesLock.GetLock());
+    *slot = state;
+}
+
+void Eluna::DestroyMapState(Map* map)
+{
+    Eluna* state = NULL;
+    {
+        ElunaUtil::RWLockable::WriteGuard guard(mapStatesLock.GetLock());
+        MapStates::iterator it = mapStates.find(map);
+        if (it == mapStates.end())
+            return;
+        state = it->second;
+        mapStates.erase(it);
+    }
+
+    if (!state)
+        return;
+
+    // Objects that left the map can still hold timed events of the state
+    eventMgr->DetachEvents(state);
+    delete state;
+}
+
+void Eluna::DestroyMapStates()
+{
+    ElunaUtil::RWLockable::WriteGuard guard(mapStatesLock.GetLock());
+    for (MapStates::iterator it = mapStates.begin(); it != mapStates.end(); ++it)
+        delete it->second;
+    mapStates.clear();
+}
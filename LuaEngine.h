@@ -19,6 +19,10 @@
 #include "Weather.h"
 #include "World.h"
 #include "Hooks.h"
+#include "ElunaUtility.h"
+#include "ElunaCron.h"
+#include <atomic>
+#include <memory>
 
 extern "C"
 {
@@ -49,6 +53,7 @@ class Channel;
 class Corpse;
 class Creature;
 class CreatureAI;
+struct ElunaCreatureAI;
 class GameObject;
 #ifdef TRINITY
 class GameObjectAI;
@@ -84,6 +89,7 @@ typedef VehicleInfo Vehicle;
 
 struct lua_State;
 class EventMgr;
+class ElunaAsyncResults;
 class ElunaObject;
 template<typename T>
 class ElunaTemplate;
@@ -102,8 +108,9 @@ struct LuaScript
     std::string modulepath;
 };
 
-#define ELUNA_OBJECT_STORE  "Eluna Object Store"
-#define LOCK_ELUNA Eluna::Guard __guard(Eluna::GetLock())
+// Locks the state the member function is called on, use Eluna::GetLock() in static context
+// The function name is recorded by the lock profiler
+#define LOCK_ELUNA Eluna::Guard __guard(GetStateLock(), __FUNCTION__)
 
 class Eluna
 {
@@ -111,17 +118,97 @@ public:
     typedef std::list<LuaScript> ScriptList;
 #ifdef TRINITY
     typedef std::recursive_mutex LockType;
-    typedef std::lock_guard<LockType> Guard;
+    typedef ElunaUtil::ProfiledGuard<std::lock_guard<LockType>, LockType, ElunaUtil::LockProfiler::LOCK_STATE> Guard;
 #else
     typedef ACE_Recursive_Thread_Mutex LockType;
-    typedef ACE_Guard<LockType> Guard;
+    typedef ElunaUtil::ProfiledGuard<ACE_Guard<LockType>, LockType, ElunaUtil::LockProfiler::LOCK_STATE> Guard;
 #endif
 
+    typedef UNORDERED_MAP<Map*, Eluna*> MapStates;
+
+    // A hook call recorded for deferred handlers. Objects are stored by GUID, other arguments by value
+    struct DeferredEvent
+    {
+        struct Value
+        {
+            Value(uint64 _value, bool _guid) : value(_value), guid(_guid) { }
+            uint64 value;
+            bool guid;
+        };
+
+        DeferredEvent(uint8 _regtype, uint32 _evt) : regtype(_regtype), evt(_evt), next(NULL) { }
+        void Add(uint64 value) { values.push_back(Value(value, false)); }
+        void AddGuid(uint64 guid) { values.push_back(Value(guid, true)); }
+
+        uint8 regtype;
+        uint32 evt;
+        std::vector<Value> values;
+        DeferredEvent* next;
+    };
+
+    // Set while the functions of a per update event are pushed, see CallAllUpdateFunctions
+    struct UpdateContext
+    {
+        UpdateContext(uint64 _key, uint32 _diff) : key(_key), diff(_diff) { }
+
+        uint64 key;                 // Object or map the update is for, interval bindings keep their time per key
+        uint32 diff;
+        std::vector<uint32> diffs;  // Diff to pass to each pushed function, time accumulated for interval bindings
+    };
+
+    // Creatures of a map queued for CREATURE_EVENT_ON_AIUPDATE_BATCH on its update, see ProcessAIUpdateBatch
+    struct AIUpdateBatch
+    {
+        struct Queued
+        {
+            Queued(uint64 _guid, ElunaCreatureAI* _ai, uint32 _diff) : guid(_guid), ai(_ai), diff(_diff) { }
+
+            uint64 guid;
+            ElunaCreatureAI* ai;    // Compared to the creature's AI when the batch is called, the creature may be gone by then
+            uint32 diff;
+        };
+
+        // Queued creatures by entry, the vectors are kept to reuse their memory
+        UNORDERED_MAP<uint32, std::vector<Queued> > entries;
+    };
+    typedef UNORDERED_MAP<Map*, AIUpdateBatch> AIUpdateBatches;
+
+    // A coroutine started with StartCoroutine that is waiting to be resumed, see ProcessCoroutines
+    struct Coroutine
+    {
+        enum WaitType
+        {
+            WAIT_TIME,      // Wait(ms) or coroutine.yield(), resumed when wakeTime is reached
+            WAIT_UNTIL,     // WaitUntil(predicate[, timeout]), resumed when the predicate returns true or on timeout
+            WAIT_EVENT,     // WaitEvent(name[, timeout]), resumed by SignalEvent or on timeout
+            WAIT_READY      // Resume arguments are on the thread's stack, resumed on the next update
+        };
+
+        Coroutine() : thread(NULL), threadRef(0), wait(WAIT_TIME), wakeTime(0), predicateRef(0), args(0), pass(0), job(false), sliceStart(0), sliceInstructions(0) { }
+
+        lua_State* thread;
+        int threadRef;      // Registry reference keeping the thread alive
+        WaitType wait;
+        uint64 wakeTime;    // Time to resume at or time out, 0 for no timeout
+        int predicateRef;
+        std::string event;
+        int args;           // Arguments to resume with when WAIT_READY
+        uint32 pass;        // ProcessCoroutines pass the wait was made on
+        bool job;           // Started with StartJob, yields automatically when its slice is used up
+        uint64 sliceStart;  // Time in microseconds the job was resumed at
+        uint32 sliceInstructions;
+    };
+
 private:
     static bool reload;
     static bool initialized;
     static LockType lock;
 
+    // Lua states of maps when Eluna.MapStates is enabled, see GetMapState
+    static bool usemapstates;
+    static MapStates mapStates;
+    static ElunaUtil::RWLockable mapStatesLock;
+
     // Lua script locations
     static ScriptList lua_scripts;
     static ScriptList lua_extensions;
@@ -132,12 +219,33 @@ private:
     static std::string lua_requirepath;
 
     uint32 event_level;
+    // Increased each time the call stack is left (event_level drops to 0).
+    //   Pushed objects are valid only while this matches their own id, see ElunaObject::IsValid.
+    uint64 callstackid;
     // When a hook pushes arguments to be passed to event handlers
     //   this is used to keep track of how many arguments were pushed.
     uint8 push_counter;
     bool enabled;
-
-    Eluna();
+    // Whether errors are reported with a traceback, read from config when the lua state is opened
+    bool usetrace;
+
+    // Coroutines waiting to be resumed and the time they wait on, advanced by ProcessCoroutines
+    std::vector<Coroutine> coroutines;
+    uint64 coroutineTime;
+    uint32 coroutinePass;
+    // Coroutine being resumed, Wait functions only work inside it
+    Coroutine* runningCoroutine;
+    // Instructions and microseconds a StartJob job runs for on each update, read from config when the lua state is opened
+    uint32 jobInstructions;
+    uint32 jobMicroseconds;
+
+    // Map this state runs the scripts of, NULL for the world state
+    Map* const ownerMap;
+    // The world state uses the static lock, map states lock only themselves
+    LockType ownLock;
+    LockType* stateLock;
+
+    Eluna(Map* map, Eluna** self);
     ~Eluna();
 
     // Prevent copy
@@ -148,8 +256,25 @@ private:
     void CloseLua();
     void DestroyBindStores();
     void CreateBindStores();
-    bool ExecuteCall(int params, int res);
+    // Calls the function under the params. If traceback is not 0 it is the stack index of an already pushed error handler
+    bool ExecuteCall(int params, int res, int traceback = 0);
     void InvalidateObjects();
+    // Queues the event for the deferred handlers, safe to call from any thread
+    void Defer(DeferredEvent* deferred);
+    // Calls the deferred handlers once per event type with all events queued since the last call
+    void ProcessDeferredEvents();
+    // Calls the RunAsync callbacks of finished jobs
+    void ProcessAsyncResults();
+    // Resumes the waiting coroutines that are due
+    void ProcessCoroutines(uint32 diff);
+    // Resumes the coroutine with the arguments on top of its stack, it is queued again if it waits
+    void ResumeCoroutine(Coroutine co, lua_State* from, int args);
+    // Checks the coroutine's wait, pushing the resume arguments to its thread if it is due
+    bool IsCoroutineDue(uint32 index, int& args);
+    // Calls the cron events whose time has passed
+    void ProcessCronEvents();
+    // Calls the CREATURE_EVENT_ON_AIUPDATE_BATCH handlers once per entry with the creatures queued on the map's update
+    void ProcessAIUpdateBatch(Map* map);
 
     // Use ReloadEluna() to make eluna reload
     // This is called on world update to reload eluna
@@ -157,18 +282,30 @@ private:
     static void LoadScriptPaths();
     static void GetScripts(std::string path);
     static void AddScriptPath(std::string filename, const std::string& fullpath);
+    static void DestroyMapStates();
+
+    void CreateMapState(Map* map);
+    void DestroyMapState(Map* map);
 
     static int StackTrace(lua_State *_L);
+    // Count hook of jobs, yields the job once its slice is used up
+    static void JobHook(lua_State* _L, lua_Debug* ar);
     static void Report(lua_State* _L);
+    // Reports the error on top of the stack, used by the dispatcher
+    static int ReportError(lua_State* _L);
+    static int AtPanic(lua_State* _L);
+    static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
 
     // Some helpers for hooks to call event handlers.
     // The bodies of the templates are in HookHelpers.h, so if you want to use them you need to #include "HookHelpers.h".
     template<typename T> int SetupStack(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings, UniqueBind<T>* guid_bindings, T event_id, uint32 entry, uint64 guid, uint32 instanceId, int number_of_arguments);
                          int CallOneFunction(int number_of_functions, int number_of_arguments, int number_of_results);
+                         bool DispatchFunctions(int number_of_functions, int number_of_arguments, bool default_value, const std::vector<uint32>* diffs, bool& result);
                          void CleanUpStack(int number_of_arguments);
     template<typename T> void ReplaceArgument(T value, uint8 index);
     template<typename T> void CallAllFunctions(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings, UniqueBind<T>* guid_bindings, T event_id, uint32 entry, uint64 guid, uint32 instanceId);
     template<typename T> bool CallAllFunctionsBool(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings, UniqueBind<T>* guid_bindings, T event_id, uint32 entry, uint64 guid, uint32 instanceId, bool default_value);
+    template<typename T> bool CallAllUpdateFunctions(EventBind<T>* event_bindings, EntryBind<T>* entry_bindings, UniqueBind<T>* guid_bindings, T event_id, uint32 entry, uint64 guid, uint32 instanceId, uint64 key, uint32 diff);
 
     // Convenient overloads for Setup. Use these in hooks instead of original.
     template<typename T> int SetupStack(EventBind<T>* event_bindings, T event_id, int number_of_arguments)
@@ -198,6 +335,20 @@ private:
         CallAllFunctions((EventBind<T>*)NULL, entry_bindings, guid_bindings, event_id, entry, guid, instanceId);
     }
 
+    // Convenient overloads for CallAllUpdateFunctions. Use these in per update hooks instead of original.
+    template<typename T> bool CallAllUpdateFunctions(EventBind<T>* event_bindings, T event_id, uint64 key, uint32 diff)
+    {
+        return CallAllUpdateFunctions(event_bindings, (EntryBind<T>*)NULL, (UniqueBind<T>*)NULL, event_id, 0, 0, 0, key, diff);
+    }
+    template<typename T> bool CallAllUpdateFunctions(EntryBind<T>* entry_bindings, T event_id, uint32 entry, uint64 key, uint32 diff)
+    {
+        return CallAllUpdateFunctions((EventBind<T>*)NULL, entry_bindings, (UniqueBind<T>*)NULL, event_id, entry, 0, 0, key, diff);
+    }
+    template<typename T> bool CallAllUpdateFunctions(EntryBind<T>* entry_bindings, UniqueBind<T>* guid_bindings, T event_id, uint32 entry, uint64 guid, uint32 instanceId, uint64 key, uint32 diff)
+    {
+        return CallAllUpdateFunctions((EventBind<T>*)NULL, entry_bindings, guid_bindings, event_id, entry, guid, instanceId, key, diff);
+    }
+
     // Convenient overloads for CallAllFunctionsBool. Use these in hooks instead of original.
     template<typename T> bool CallAllFunctionsBool(EventBind<T>* event_bindings, T event_id, bool default_value = false)
     {
@@ -218,6 +369,37 @@ public:
     lua_State* L;
     EventMgr* eventMgr;
 
+    // Increased whenever bindings are added or removed, used to refresh cached binding information
+    std::atomic<uint32> bindGeneration;
+
+    // Registry reference to the weak valued table of pushed userdata, keyed by object pointer (light userdata)
+    int userdata_table;
+    // Registry reference to the function calling all handlers of a hook, see DispatchFunctions
+    int dispatcher;
+    // Registry references to weak valued tables of pushed 64 bit integers keyed by their value
+    int int64_table;
+    int uint64_table;
+    // Deferred events pushed by hooks, newest first. Lock free so hooks don't wait for lua
+    std::atomic<DeferredEvent*> deferredEvents;
+
+    // Finished RunAsync jobs, replaced when the lua state is reopened
+    std::shared_ptr<ElunaAsyncResults> asyncResults;
+
+    // Events created with CreateCronEvent, cleared when the lua state is closed
+    ElunaCronScheduler cronEvents;
+
+    // Context of the per update event being pushed, NULL otherwise
+    UpdateContext* updateContext;
+
+    // AI updates queued for batched handlers per map. Only the map's own update touches its batch,
+    //   the lock guards adding and removing maps
+    AIUpdateBatches aiUpdateBatches;
+    ElunaUtil::RWLockable aiUpdateBatchesLock;
+
+    // Object store lookup counters for pushed objects, see GetObjectStoreStats
+    uint64 objectStoreHits;
+    uint64 objectStoreMisses;
+
     EventBind<Hooks::ServerEvents>*     ServerEventBindings;
     EventBind<Hooks::PlayerEvents>*     PlayerEventBindings;
     EventBind<Hooks::GuildEvents>*      GuildEventBindings;
@@ -225,6 +407,9 @@ public:
     EventBind<Hooks::VehicleEvents>*    VehicleEventBindings;
     EventBind<Hooks::BGEvents>*         BGEventBindings;
 
+    EventBind<Hooks::PlayerEvents>*     PlayerDeferredBindings;
+    EventBind<Hooks::GuildEvents>*      GuildDeferredBindings;
+
     EntryBind<Hooks::PacketEvents>*     PacketEventBindings;
     EntryBind<Hooks::CreatureEvents>*   CreatureEventBindings;
     EntryBind<Hooks::GossipEvents>*     CreatureGossipBindings;
@@ -239,9 +424,21 @@ public:
     static void Initialize();
     static void Uninitialize();
     // This function is used to make eluna reload
-    static void ReloadEluna() { LOCK_ELUNA; reload = true; }
+    static void ReloadEluna() { Guard guard(GetLock()); reload = true; }
     static LockType& GetLock() { return lock; };
+    LockType& GetStateLock() { return *stateLock; }
+    // Returns the state that runs the scripts of the map, this state if map states are not used
+    Eluna* GetMapState(Map* map);
+
+    // Runs the function under the arguments on top of the stack as a coroutine, see StartJob for jobs
+    void StartCoroutine(lua_State* from, int args, bool job = false);
+    // Sets the wait of the coroutine resumed last, false if the thread is not a coroutine started with StartCoroutine
+    bool WaitCoroutine(lua_State* thread, Coroutine::WaitType wait, uint32 timeout, int predicateRef = 0, const char* event = NULL);
+    // Makes the coroutines waiting for the event resume with true and the arguments from the index up
+    void SignalCoroutines(lua_State* from, const char* event, int index);
     static bool IsInitialized() { return initialized; }
+    // Returns the Eluna instance that owns the given lua state
+    static Eluna* GetEluna(lua_State* luastate);
 
     // Static pushes, can be used by anything, including methods.
     static void Push(lua_State* luastate); // nil
@@ -270,7 +467,10 @@ public:
     void RunScripts();
     bool GetReload() const { return reload; }
     bool IsEnabled() const { return enabled && IsInitialized(); }
-    void Register(uint8 reg, uint32 id, uint64 guid, uint32 instanceId, uint32 evt, int func, uint32 shots);
+    uint64 GetCallstackId() const { return callstackid; }
+    // Map whose scripts the state runs, NULL for the world state
+    Map* GetOwnerMap() const { return ownerMap; }
+    void Register(uint8 reg, uint32 id, uint64 guid, uint32 instanceId, uint32 evt, int func, uint32 shots, bool deferred = false, uint32 interval = 0);
 
     // Non-static pushes, to be used in hooks.
     // These just call the correct static version with the main thread's Lua state.
@@ -299,12 +499,15 @@ public:
     {
         return ElunaTemplate<T>::Check(luastate, narg, error);
     }
-    static ElunaObject* CHECKTYPE(lua_State* luastate, int narg, const char *tname, bool error = true);
+    // Returns the ElunaObject at narg if its type mask has all bits of typeMask set. Type mask 0 accepts any ElunaObject
+    static ElunaObject* CHECKTYPE(lua_State* luastate, int narg, const char *tname, uint64 typeMask, bool error = true);
 
     CreatureAI* GetAI(Creature* creature);
+    // Returns the bits (1 << event) of the creature events the creature has bindings for, by entry or by guid
+    uint64 GetCreatureEventMask(Creature* creature);
 
     /* Custom */
-    void OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* obj);
+    void OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* obj, Map* map = NULL);
     bool OnCommand(Player* player, const char* text);
     void OnWorldUpdate(uint32 diff);
     void OnLootItem(Player* pPlayer, Item* pItem, uint32 count, uint64 guid);
@@ -341,6 +544,8 @@ public:
 
     bool OnSummoned(Creature* creature, Unit* summoner);
     bool UpdateAI(Creature* me, const uint32 diff);
+    // Queues the creature for the CREATURE_EVENT_ON_AIUPDATE_BATCH handlers of its entry, returns false if there are none
+    bool QueueAIUpdate(Creature* me, ElunaCreatureAI* ai, uint32 diff);
     bool EnterCombat(Creature* me, Unit* target);
     bool DamageTaken(Creature* me, Unit* attacker, uint32& damage);
     bool JustDied(Creature* me, Unit* killer);
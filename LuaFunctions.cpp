@@ -15,6 +15,8 @@ extern "C"
 #include "ElunaIncludes.h"
 #include "ElunaTemplate.h"
 #include "ElunaUtility.h"
+#include "ElunaSharedData.h"
+#include "ElunaWorkerPool.h"
 
 // Method includes
 #include "GlobalMethods.h"
@@ -37,6 +39,8 @@ extern "C"
 #include "VehicleMethods.h"
 #include "BattleGroundMethods.h"
 
+#include <mutex>
+
 ElunaGlobal::ElunaRegister GlobalMethods[] =
 {
     // Hooks
@@ -72,9 +76,19 @@ ElunaGlobal::ElunaRegister GlobalMethods[] =
 
     // Getters
     { "GetLuaEngine", &LuaGlobalFunctions::GetLuaEngine },
+    { "GetStateMap", &LuaGlobalFunctions::GetStateMap },
     { "GetCoreName", &LuaGlobalFunctions::GetCoreName },
     { "GetCoreVersion", &LuaGlobalFunctions::GetCoreVersion },
     { "GetCoreExpansion", &LuaGlobalFunctions::GetCoreExpansion },
+    { "GetObjectStoreStats", &LuaGlobalFunctions::GetObjectStoreStats },
+    { "GetSharedData", &LuaGlobalFunctions::GetSharedData },
+    { "SetSharedData", &LuaGlobalFunctions::SetSharedData },
+    { "AddSharedData", &LuaGlobalFunctions::AddSharedData },
+    { "RunAsync", &LuaGlobalFunctions::RunAsync },
+    { "GetLockStats", &LuaGlobalFunctions::GetLockStats },
+    { "ResetLockStats", &LuaGlobalFunctions::ResetLockStats },
+    { "GetEventStats", &LuaGlobalFunctions::GetEventStats },
+    { "ResetEventStats", &LuaGlobalFunctions::ResetEventStats },
     { "GetQuest", &LuaGlobalFunctions::GetQuest },
     { "GetPlayerByGUID", &LuaGlobalFunctions::GetPlayerByGUID },
     { "GetPlayerByName", &LuaGlobalFunctions::GetPlayerByName },
@@ -124,6 +138,17 @@ ElunaGlobal::ElunaRegister GlobalMethods[] =
     { "CreateLuaEvent", &LuaGlobalFunctions::CreateLuaEvent },
     { "RemoveEventById", &LuaGlobalFunctions::RemoveEventById },
     { "RemoveEvents", &LuaGlobalFunctions::RemoveEvents },
+    { "CreateCronEvent", &LuaGlobalFunctions::CreateCronEvent },
+    { "RemoveCronEvent", &LuaGlobalFunctions::RemoveCronEvent },
+    { "RemoveEventsByTag", &LuaGlobalFunctions::RemoveEventsByTag },
+    { "PauseEventsByTag", &LuaGlobalFunctions::PauseEventsByTag },
+    { "ResumeEventsByTag", &LuaGlobalFunctions::ResumeEventsByTag },
+    { "StartCoroutine", &LuaGlobalFunctions::StartCoroutine },
+    { "StartJob", &LuaGlobalFunctions::StartJob },
+    { "Wait", &LuaGlobalFunctions::Wait },
+    { "WaitUntil", &LuaGlobalFunctions::WaitUntil },
+    { "WaitEvent", &LuaGlobalFunctions::WaitEvent },
+    { "SignalEvent", &LuaGlobalFunctions::SignalEvent },
     { "PerformIngameSpawn", &LuaGlobalFunctions::PerformIngameSpawn },
     { "CreatePacket", &LuaGlobalFunctions::CreatePacket },
     { "AddVendorItem", &LuaGlobalFunctions::AddVendorItem },
@@ -1203,6 +1228,11 @@ ElunaRegister<Map> MapMethods[] =
 #endif
     { "IsRaid", &LuaMap::IsRaid },                            // :IsRaid() - Returns the true if the map is a raid map, else false UNDOCUMENTED
 
+    // Other
+    { "RegisterEvent", &LuaMap::RegisterEvent },
+    { "RemoveEventById", &LuaMap::RemoveEventById },
+    { "RemoveEvents", &LuaMap::RemoveEvents },
+
     { NULL, NULL },
 };
 
@@ -1252,6 +1282,8 @@ ElunaRegister<BattleGround> BattleGroundMethods[] =
 
 template<typename T> const char* ElunaTemplate<T>::tname = NULL;
 template<typename T> bool ElunaTemplate<T>::manageMemory = false;
+template<typename T> uint32 ElunaTemplate<T>::typeId = 0;
+template<typename T> uint64 ElunaTemplate<T>::typeMask = 0;
 
 #if (!defined(TBC) && !defined(CLASSIC))
 // fix compile error about accessing vehicle destructor
@@ -1261,11 +1293,28 @@ template<> int ElunaTemplate<Vehicle>::CollectGarbage(lua_State* L)
 
     // Get object pointer (and check type, no error)
     ElunaObject* obj = Eluna::CHECKOBJ<ElunaObject>(L, 1, false);
-    delete obj;
+    if (obj)
+        obj->~ElunaObject();
     return 0;
 }
 #endif
 
+// 64 bit integers are stored in the userdata block, see Eluna::Push(lua_State*, long long)
+template<> int ElunaTemplate<long long>::CollectGarbage(lua_State* L)
+{
+    ElunaObject* obj = Eluna::CHECKOBJ<ElunaObject>(L, 1, false);
+    if (obj)
+        obj->~ElunaObject();
+    return 0;
+}
+template<> int ElunaTemplate<unsigned long long>::CollectGarbage(lua_State* L)
+{
+    ElunaObject* obj = Eluna::CHECKOBJ<ElunaObject>(L, 1, false);
+    if (obj)
+        obj->~ElunaObject();
+    return 0;
+}
+
 // Template by Mud from http://stackoverflow.com/questions/4484437/lua-integer-type/4485511#4485511
 template<> int ElunaTemplate<unsigned long long>::Add(lua_State* L) { Eluna::Push(L, Eluna::CHECKVAL<unsigned long long>(L, 1) + Eluna::CHECKVAL<unsigned long long>(L, 2)); return 1; }
 template<> int ElunaTemplate<unsigned long long>::Substract(lua_State* L) { Eluna::Push(L, Eluna::CHECKVAL<unsigned long long>(L, 1) - Eluna::CHECKVAL<unsigned long long>(L, 2)); return 1; }
@@ -1313,86 +1362,147 @@ template<> int ElunaTemplate<long long>::ToString(lua_State* L)
     return 1;
 }
 
+// Type ids, masks and names are shared by all states and only set once
+static void RegisterTypes()
+{
+    ElunaTemplate<Object>::RegisterType("Object");
+
+    ElunaTemplate<WorldObject>::RegisterType("WorldObject");
+    ElunaTemplate<WorldObject>::SetBaseType<Object>();
+
+    ElunaTemplate<Unit>::RegisterType("Unit");
+    ElunaTemplate<Unit>::SetBaseType<WorldObject>();
+
+    ElunaTemplate<Player>::RegisterType("Player");
+    ElunaTemplate<Player>::SetBaseType<Unit>();
+
+    ElunaTemplate<Creature>::RegisterType("Creature");
+    ElunaTemplate<Creature>::SetBaseType<Unit>();
+
+    ElunaTemplate<GameObject>::RegisterType("GameObject");
+    ElunaTemplate<GameObject>::SetBaseType<WorldObject>();
+
+    ElunaTemplate<Corpse>::RegisterType("Corpse");
+    ElunaTemplate<Corpse>::SetBaseType<WorldObject>();
+
+    ElunaTemplate<Item>::RegisterType("Item");
+    ElunaTemplate<Item>::SetBaseType<Object>();
+
+#ifndef CLASSIC
+#ifndef TBC
+    ElunaTemplate<Vehicle>::RegisterType("Vehicle");
+#endif
+#endif
+
+    ElunaTemplate<Group>::RegisterType("Group");
+
+    ElunaTemplate<Guild>::RegisterType("Guild");
+
+    ElunaTemplate<Aura>::RegisterType("Aura");
+
+    ElunaTemplate<Spell>::RegisterType("Spell");
+
+    ElunaTemplate<Quest>::RegisterType("Quest");
+
+    ElunaTemplate<Map>::RegisterType("Map");
+
+    ElunaTemplate<AuctionHouseObject>::RegisterType("AuctionHouseObject");
+
+    ElunaTemplate<BattleGround>::RegisterType("BattleGround");
+
+    ElunaTemplate<WorldPacket>::RegisterType("WorldPacket", true);
+
+    ElunaTemplate<ElunaQuery>::RegisterType("ElunaQuery", true);
+
+    ElunaTemplate<long long>::RegisterType("long long", true);
+
+    ElunaTemplate<unsigned long long>::RegisterType("unsigned long long", true);
+}
+
 void RegisterFunctions(Eluna* E)
 {
+    // Map states can be created on map threads, see Eluna::CreateMapState
+    static std::once_flag typesRegistered;
+    std::call_once(typesRegistered, RegisterTypes);
+
     ElunaGlobal::SetMethods(E, GlobalMethods);
 
-    ElunaTemplate<Object>::Register(E, "Object");
+    ElunaTemplate<Object>::Register(E);
     ElunaTemplate<Object>::SetMethods(E, ObjectMethods);
 
-    ElunaTemplate<WorldObject>::Register(E, "WorldObject");
+    ElunaTemplate<WorldObject>::Register(E);
     ElunaTemplate<WorldObject>::SetMethods(E, ObjectMethods);
     ElunaTemplate<WorldObject>::SetMethods(E, WorldObjectMethods);
 
-    ElunaTemplate<Unit>::Register(E, "Unit");
+    ElunaTemplate<Unit>::Register(E);
     ElunaTemplate<Unit>::SetMethods(E, ObjectMethods);
     ElunaTemplate<Unit>::SetMethods(E, WorldObjectMethods);
     ElunaTemplate<Unit>::SetMethods(E, UnitMethods);
 
-    ElunaTemplate<Player>::Register(E, "Player");
+    ElunaTemplate<Player>::Register(E);
     ElunaTemplate<Player>::SetMethods(E, ObjectMethods);
     ElunaTemplate<Player>::SetMethods(E, WorldObjectMethods);
     ElunaTemplate<Player>::SetMethods(E, UnitMethods);
     ElunaTemplate<Player>::SetMethods(E, PlayerMethods);
 
-    ElunaTemplate<Creature>::Register(E, "Creature");
+    ElunaTemplate<Creature>::Register(E);
     ElunaTemplate<Creature>::SetMethods(E, ObjectMethods);
     ElunaTemplate<Creature>::SetMethods(E, WorldObjectMethods);
     ElunaTemplate<Creature>::SetMethods(E, UnitMethods);
     ElunaTemplate<Creature>::SetMethods(E, CreatureMethods);
 
-    ElunaTemplate<GameObject>::Register(E, "GameObject");
+    ElunaTemplate<GameObject>::Register(E);
     ElunaTemplate<GameObject>::SetMethods(E, ObjectMethods);
     ElunaTemplate<GameObject>::SetMethods(E, WorldObjectMethods);
     ElunaTemplate<GameObject>::SetMethods(E, GameObjectMethods);
 
-    ElunaTemplate<Corpse>::Register(E, "Corpse");
+    ElunaTemplate<Corpse>::Register(E);
     ElunaTemplate<Corpse>::SetMethods(E, ObjectMethods);
     ElunaTemplate<Corpse>::SetMethods(E, WorldObjectMethods);
     ElunaTemplate<Corpse>::SetMethods(E, CorpseMethods);
 
-    ElunaTemplate<Item>::Register(E, "Item");
+    ElunaTemplate<Item>::Register(E);
     ElunaTemplate<Item>::SetMethods(E, ObjectMethods);
     ElunaTemplate<Item>::SetMethods(E, ItemMethods);
 
 #ifndef CLASSIC
 #ifndef TBC
-    ElunaTemplate<Vehicle>::Register(E, "Vehicle");
+    ElunaTemplate<Vehicle>::Register(E);
     ElunaTemplate<Vehicle>::SetMethods(E, VehicleMethods);
 #endif
 #endif
 
-    ElunaTemplate<Group>::Register(E, "Group");
+    ElunaTemplate<Group>::Register(E);
     ElunaTemplate<Group>::SetMethods(E, GroupMethods);
 
-    ElunaTemplate<Guild>::Register(E, "Guild");
+    ElunaTemplate<Guild>::Register(E);
     ElunaTemplate<Guild>::SetMethods(E, GuildMethods);
 
-    ElunaTemplate<Aura>::Register(E, "Aura");
+    ElunaTemplate<Aura>::Register(E);
     ElunaTemplate<Aura>::SetMethods(E, AuraMethods);
 
-    ElunaTemplate<Spell>::Register(E, "Spell");
+    ElunaTemplate<Spell>::Register(E);
     ElunaTemplate<Spell>::SetMethods(E, SpellMethods);
 
-    ElunaTemplate<Quest>::Register(E, "Quest");
+    ElunaTemplate<Quest>::Register(E);
     ElunaTemplate<Quest>::SetMethods(E, QuestMethods);
 
-    ElunaTemplate<Map>::Register(E, "Map");
+    ElunaTemplate<Map>::Register(E);
     ElunaTemplate<Map>::SetMethods(E, MapMethods);
 
-    ElunaTemplate<AuctionHouseObject>::Register(E, "AuctionHouseObject");
+    ElunaTemplate<AuctionHouseObject>::Register(E);
     ElunaTemplate<AuctionHouseObject>::SetMethods(E, AuctionMethods);
 
-    ElunaTemplate<BattleGround>::Register(E, "BattleGround");
+    ElunaTemplate<BattleGround>::Register(E);
     ElunaTemplate<BattleGround>::SetMethods(E, BattleGroundMethods);
 
-    ElunaTemplate<WorldPacket>::Register(E, "WorldPacket", true);
+    ElunaTemplate<WorldPacket>::Register(E);
     ElunaTemplate<WorldPacket>::SetMethods(E, PacketMethods);
 
-    ElunaTemplate<ElunaQuery>::Register(E, "ElunaQuery", true);
+    ElunaTemplate<ElunaQuery>::Register(E);
     ElunaTemplate<ElunaQuery>::SetMethods(E, QueryMethods);
 
-    ElunaTemplate<long long>::Register(E, "long long", true);
+    ElunaTemplate<long long>::Register(E);
 
-    ElunaTemplate<unsigned long long>::Register(E, "unsigned long long", true);
+    ElunaTemplate<unsigned long long>::Register(E);
 }
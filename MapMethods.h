@@ -277,5 +277,60 @@ namespace LuaMap
 #endif
         return 0;
     }
+
+    /**
+     * Registers a timed event to the [Map]
+     * When the passed function is called, the parameters `(eventId, delay, repeats, map)` are passed to it.
+     * Repeats will decrease on each call if the event does not repeat indefinitely
+     *
+     * The events tick on the [Map]'s update regardless of players being near, and are removed when the [Map] is destroyed.
+     * Adding and removing the events takes effect on the [Map]'s next update, so they can be used from any script.
+     *
+     * @param function function : function to trigger when the time has passed
+     * @param uint32 delay : set time in milliseconds for the event to trigger
+     * @param uint32 repeats : how many times for the event to repeat, 0 is infinite
+     * @param string tag = nil : optional tag for the event, see [Global:RemoveEventsByTag]
+     * @return int eventId : unique ID for the timed event used to cancel it or nil
+     */
+    int RegisterEvent(Eluna* E, lua_State* L, Map* map)
+    {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        uint32 delay = Eluna::CHECKVAL<uint32>(L, 3);
+        uint32 repeats = Eluna::CHECKVAL<uint32>(L, 4);
+        std::string tag = Eluna::CHECKVAL<std::string>(L, 5, "");
+
+        lua_pushvalue(L, 2);
+        int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (functionRef != LUA_REFNIL && functionRef != LUA_NOREF)
+        {
+            E->eventMgr->GetMapProcessor(map, true)->AddEvent(E, functionRef, delay, repeats, tag.empty() ? 0 : E->eventMgr->GetTagId(tag));
+            Eluna::Push(L, functionRef);
+        }
+        return 1;
+    }
+
+    /**
+     * Removes the timed event from a [Map] by the specified event ID
+     *
+     * @param int eventId : event Id to remove
+     */
+    int RemoveEventById(Eluna* E, lua_State* L, Map* map)
+    {
+        int eventId = Eluna::CHECKVAL<int>(L, 2);
+        if (ElunaEventProcessor* processor = E->eventMgr->GetMapProcessor(map, false))
+            processor->RemoveEvent(E, eventId);
+        return 0;
+    }
+
+    /**
+     * Removes all timed events from a [Map]
+     *
+     */
+    int RemoveEvents(Eluna* E, lua_State* /*L*/, Map* map)
+    {
+        if (ElunaEventProcessor* processor = E->eventMgr->GetMapProcessor(map, false))
+            processor->RemoveEvents(E);
+        return 0;
+    }
 };
 #endif
@@ -92,6 +92,21 @@ bool Eluna::OnCommand(Player* player, const char* text)
                     return false;
                 }
             }
+            else if (reload == "eluna")
+            {
+                // eluna locks [reset], lock profiler stats are written to the log
+                std::transform(eluna.begin(), eluna.end(), eluna.begin(), ::tolower);
+                if (eluna == "locks")
+                {
+                    ElunaUtil::LockProfiler::Dump();
+                    return false;
+                }
+                if (eluna == "locks reset")
+                {
+                    ElunaUtil::LockProfiler::Reset();
+                    return false;
+                }
+            }
         }
     }
 
@@ -106,6 +121,16 @@ bool Eluna::OnCommand(Player* player, const char* text)
 
 void Eluna::OnLootItem(Player* pPlayer, Item* pItem, uint32 count, uint64 guid)
 {
+    if (PlayerDeferredBindings->HasEvents(PLAYER_EVENT_ON_LOOT_ITEM))
+    {
+        DeferredEvent* deferred = new DeferredEvent(REGTYPE_PLAYER, PLAYER_EVENT_ON_LOOT_ITEM);
+        deferred->AddGuid(pPlayer->GET_GUID());
+        deferred->AddGuid(pItem->GET_GUID());
+        deferred->Add(count);
+        deferred->AddGuid(guid);
+        Defer(deferred);
+    }
+
     if (!PlayerEventBindings->HasEvents(PLAYER_EVENT_ON_LOOT_ITEM))
         return;
 
@@ -229,6 +254,14 @@ void Eluna::OnPlayerLeaveCombat(Player* pPlayer)
 
 void Eluna::OnPVPKill(Player* pKiller, Player* pKilled)
 {
+    if (PlayerDeferredBindings->HasEvents(PLAYER_EVENT_ON_KILL_PLAYER))
+    {
+        DeferredEvent* deferred = new DeferredEvent(REGTYPE_PLAYER, PLAYER_EVENT_ON_KILL_PLAYER);
+        deferred->AddGuid(pKiller->GET_GUID());
+        deferred->AddGuid(pKilled->GET_GUID());
+        Defer(deferred);
+    }
+
     if (!PlayerEventBindings->HasEvents(PLAYER_EVENT_ON_KILL_PLAYER))
         return;
 
@@ -240,6 +273,14 @@ void Eluna::OnPVPKill(Player* pKiller, Player* pKilled)
 
 void Eluna::OnCreatureKill(Player* pKiller, Creature* pKilled)
 {
+    if (PlayerDeferredBindings->HasEvents(PLAYER_EVENT_ON_KILL_CREATURE))
+    {
+        DeferredEvent* deferred = new DeferredEvent(REGTYPE_PLAYER, PLAYER_EVENT_ON_KILL_CREATURE);
+        deferred->AddGuid(pKiller->GET_GUID());
+        deferred->AddGuid(pKilled->GET_GUID());
+        Defer(deferred);
+    }
+
     if (!PlayerEventBindings->HasEvents(PLAYER_EVENT_ON_KILL_CREATURE))
         return;
 
@@ -262,6 +303,14 @@ void Eluna::OnPlayerKilledByCreature(Creature* pKiller, Player* pKilled)
 
 void Eluna::OnLevelChanged(Player* pPlayer, uint8 oldLevel)
 {
+    if (PlayerDeferredBindings->HasEvents(PLAYER_EVENT_ON_LEVEL_CHANGE))
+    {
+        DeferredEvent* deferred = new DeferredEvent(REGTYPE_PLAYER, PLAYER_EVENT_ON_LEVEL_CHANGE);
+        deferred->AddGuid(pPlayer->GET_GUID());
+        deferred->Add(oldLevel);
+        Defer(deferred);
+    }
+
     if (!PlayerEventBindings->HasEvents(PLAYER_EVENT_ON_LEVEL_CHANGE))
         return;
 
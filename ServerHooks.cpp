@@ -14,10 +14,66 @@
 #include "ElunaEventMgr.h"
 #include "ElunaIncludes.h"
 #include "ElunaTemplate.h"
+#include <algorithm>
+#include <map>
 
 using namespace Hooks;
 
-void Eluna::OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* obj)
+void Eluna::ProcessDeferredEvents()
+{
+    DeferredEvent* deferred = deferredEvents.exchange(NULL, std::memory_order_acquire);
+    if (!deferred)
+        return;
+
+    // The queue is newest first, group the events by type and restore the call order
+    typedef std::map<uint64, std::vector<DeferredEvent*> > DeferredGroups;
+    DeferredGroups groups;
+    for (; deferred; deferred = deferred->next)
+        groups[(uint64(deferred->regtype) << 32) | deferred->evt].push_back(deferred);
+
+    LOCK_ELUNA;
+    for (DeferredGroups::iterator it = groups.begin(); it != groups.end(); ++it)
+    {
+        std::vector<DeferredEvent*>& events = it->second;
+        std::reverse(events.begin(), events.end());
+
+        uint8 regtype = events.front()->regtype;
+        uint32 evt = events.front()->evt;
+        bool hasHandlers = regtype == REGTYPE_PLAYER ?
+            PlayerDeferredBindings->HasEvents(PlayerEvents(evt)) : GuildDeferredBindings->HasEvents(GuildEvents(evt));
+
+        if (hasHandlers)
+        {
+            // One array of records per event type, each record holds the hook's arguments in order
+            lua_createtable(L, int(events.size()), 0);
+            for (size_t i = 0; i < events.size(); ++i)
+            {
+                std::vector<DeferredEvent::Value> const& values = events[i]->values;
+                lua_createtable(L, int(values.size()), 0);
+                for (size_t j = 0; j < values.size(); ++j)
+                {
+                    if (values[j].guid)
+                        Push(L, (unsigned long long)values[j].value);
+                    else
+                        Push(L, double(values[j].value));
+                    lua_rawseti(L, -2, int(j + 1));
+                }
+                lua_rawseti(L, -2, int(i + 1));
+            }
+            ++push_counter;
+
+            if (regtype == REGTYPE_PLAYER)
+                CallAllFunctions(PlayerDeferredBindings, PlayerEvents(evt));
+            else
+                CallAllFunctions(GuildDeferredBindings, GuildEvents(evt));
+        }
+
+        for (size_t i = 0; i < events.size(); ++i)
+            delete events[i];
+    }
+}
+
+void Eluna::OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* obj, Map* map)
 {
     LOCK_ELUNA;
     ASSERT(!event_level);
@@ -29,7 +85,10 @@ void Eluna::OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* o
     Push(L, funcRef);
     Push(L, delay);
     Push(L, calls);
-    Push(L, obj);
+    if (map)
+        Push(L, map);
+    else
+        Push(L, obj);
 
     // Call function
     ExecuteCall(4, 0);
@@ -294,12 +353,19 @@ void Eluna::OnShutdownCancel()
 
 void Eluna::OnWorldUpdate(uint32 diff)
 {
+    // Timed events of the world update share one budget, see EventMgr::StartBudget
+    EventMgr::StartBudget(true);
+
     {
         LOCK_ELUNA;
         if (reload)
             _ReloadEluna();
     }
 
+    ProcessDeferredEvents();
+    ProcessAsyncResults();
+    ProcessCoroutines(diff);
+    ProcessCronEvents();
     eventMgr->globalProcessor->Update(diff);
 
     if (!ServerEventBindings->HasEvents(WORLD_EVENT_ON_UPDATE))
@@ -307,7 +373,7 @@ void Eluna::OnWorldUpdate(uint32 diff)
 
     LOCK_ELUNA;
     Push(diff);
-    CallAllFunctions(ServerEventBindings, WORLD_EVENT_ON_UPDATE);
+    CallAllUpdateFunctions(ServerEventBindings, WORLD_EVENT_ON_UPDATE, 0, diff);
 }
 
 void Eluna::OnStartup()
@@ -331,6 +397,8 @@ void Eluna::OnShutdown()
 /* Map */
 void Eluna::OnCreate(Map* map)
 {
+    CreateMapState(map);
+
     if (!ServerEventBindings->HasEvents(MAP_EVENT_ON_CREATE))
         return;
 
@@ -341,12 +409,19 @@ void Eluna::OnCreate(Map* map)
 
 void Eluna::OnDestroy(Map* map)
 {
-    if (!ServerEventBindings->HasEvents(MAP_EVENT_ON_DESTROY))
-        return;
+    if (ServerEventBindings->HasEvents(MAP_EVENT_ON_DESTROY))
+    {
+        LOCK_ELUNA;
+        Push(map);
+        CallAllFunctions(ServerEventBindings, MAP_EVENT_ON_DESTROY);
+    }
 
-    LOCK_ELUNA;
-    Push(map);
-    CallAllFunctions(ServerEventBindings, MAP_EVENT_ON_DESTROY);
+    eventMgr->RemoveMapEvents(map);
+    {
+        ElunaUtil::RWLockable::WriteGuard guard(aiUpdateBatchesLock.GetLock());
+        aiUpdateBatches.erase(map);
+    }
+    DestroyMapState(map);
 }
 
 void Eluna::OnPlayerEnter(Map* map, Player* player)
@@ -373,15 +448,39 @@ void Eluna::OnPlayerLeave(Map* map, Player* player)
 
 void Eluna::OnUpdate(Map* map, uint32 diff)
 {
+    // Timed events of the map update share one budget, the map's own state is called from here
+    if (!ownerMap)
+        EventMgr::StartBudget(false);
+
+    // Map events registered from this state, the map's own state updates the ones registered from it
+    eventMgr->UpdateMapEvents(map, diff);
+
+    Eluna* E = GetMapState(map);
+    if (E != this)
+    {
+        E->OnUpdate(map, diff);
+        return;
+    }
+
+    // Map states run their deferred events, async callbacks, coroutines, cron events and global timed events on the map's update
+    if (ownerMap)
+    {
+        ProcessDeferredEvents();
+        ProcessAsyncResults();
+        ProcessCoroutines(diff);
+        ProcessCronEvents();
+        eventMgr->globalProcessor->Update(diff);
+    }
+
+    ProcessAIUpdateBatch(map);
+
     if (!ServerEventBindings->HasEvents(MAP_EVENT_ON_UPDATE))
         return;
 
     LOCK_ELUNA;
-    // enable this for multithread
-    // eventMgr->globalProcessor->Update(diff);
     Push(map);
     Push(diff);
-    CallAllFunctions(ServerEventBindings, MAP_EVENT_ON_UPDATE);
+    CallAllUpdateFunctions(ServerEventBindings, MAP_EVENT_ON_UPDATE, (uint64(map->GetId()) << 32) | map->GetInstanceId(), diff);
 }
 
 void Eluna::OnRemove(GameObject* gameobject)
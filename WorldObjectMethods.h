@@ -619,19 +619,21 @@ namespace LuaWorldObject
      * @param function function : function to trigger when the time has passed
      * @param uint32 delay : set time in milliseconds for the event to trigger
      * @param uint32 repeats : how many times for the event to repeat, 0 is infinite
+     * @param string tag = nil : optional tag for the event, see [Global:RemoveEventsByTag]
      * @return int eventId : unique ID for the timed event used to cancel it or nil
      */
-    int RegisterEvent(Eluna* /*E*/, lua_State* L, WorldObject* obj)
+    int RegisterEvent(Eluna* E, lua_State* L, WorldObject* obj)
     {
         luaL_checktype(L, 2, LUA_TFUNCTION);
         uint32 delay = Eluna::CHECKVAL<uint32>(L, 3);
         uint32 repeats = Eluna::CHECKVAL<uint32>(L, 4);
+        std::string tag = Eluna::CHECKVAL<std::string>(L, 5, "");
 
         lua_pushvalue(L, 2);
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef != LUA_REFNIL && functionRef != LUA_NOREF)
         {
-            obj->elunaEvents->AddEvent(functionRef, delay, repeats);
+            obj->elunaEvents->AddEvent(E, functionRef, delay, repeats, tag.empty() ? 0 : E->eventMgr->GetTagId(tag));
             Eluna::Push(L, functionRef);
         }
         return 1;
@@ -642,20 +644,21 @@ namespace LuaWorldObject
      *
      * @param int eventId : event Id to remove
      */
-    int RemoveEventById(Eluna* /*E*/, lua_State* L, WorldObject* obj)
+    int RemoveEventById(Eluna* E, lua_State* L, WorldObject* obj)
     {
         int eventId = Eluna::CHECKVAL<int>(L, 2);
-        obj->elunaEvents->RemoveEvent(eventId);
+        obj->elunaEvents->RemoveEvent(E, eventId);
         return 0;
     }
 
     /**
      * Removes all timed events from a [WorldObject]
      *
+     * Only the events registered from the calling Lua state are removed, see `Eluna.MapStates`.
      */
-    int RemoveEvents(Eluna* /*E*/, lua_State* /*L*/, WorldObject* obj)
+    int RemoveEvents(Eluna* E, lua_State* /*L*/, WorldObject* obj)
     {
-        obj->elunaEvents->RemoveEvents();
+        obj->elunaEvents->RemoveEvents(E);
         return 0;
     }
 
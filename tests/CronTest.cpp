@@ -0,0 +1,186 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaTest.h"
+#include "ElunaCron.h"
+#include <cstdlib>
+
+// Specs are in local time, main sets the zone to UTC so the times below are exact
+static time_t Time(int year, int month, int day, int hour = 0, int minute = 0)
+{
+    tm date = { };
+    date.tm_year = year - 1900;
+    date.tm_mon = month - 1;
+    date.tm_mday = day;
+    date.tm_hour = hour;
+    date.tm_min = minute;
+    date.tm_isdst = -1;
+    return mktime(&date);
+}
+
+static time_t Next(const char* text, time_t after)
+{
+    ElunaCronSpec spec;
+    if (!spec.Parse(text))
+    {
+        printf("could not parse \"%s\"\n", text);
+        return -1;
+    }
+    return spec.Next(after);
+}
+
+static bool Parses(const char* text)
+{
+    ElunaCronSpec spec;
+    return spec.Parse(text);
+}
+
+static void TestSyntax()
+{
+    CHECK(Parses("* * * * *"));
+    CHECK(Parses("0 4 * * *"));
+    CHECK(Parses("0-59/15 8-20 * * 1-5"));
+    CHECK(Parses("*/5 * * * *"));
+    CHECK(Parses("1,2,3 0 1 1,6,12 0,7"));
+
+    CHECK(!Parses(""));
+    CHECK(!Parses("* * * *"));
+    CHECK(!Parses("* * * * * *"));
+    CHECK(!Parses("60 * * * *"));
+    CHECK(!Parses("* 24 * * *"));
+    CHECK(!Parses("* * 0 * *"));
+    CHECK(!Parses("* * 32 * *"));
+    CHECK(!Parses("* * * 0 *"));
+    CHECK(!Parses("* * * 13 *"));
+    CHECK(!Parses("* * * * 8"));
+    CHECK(!Parses("5-1 * * * *"));
+    CHECK(!Parses("*/0 * * * *"));
+    CHECK(!Parses("a * * * *"));
+    CHECK(!Parses("1, * * * *"));
+    CHECK(!Parses(",1 * * * *"));
+    CHECK(!Parses("1,,2 * * * *"));
+}
+
+// Days that do not exist in any of the months can never match, unless the day of week can
+static void TestImpossibleSpecs()
+{
+    CHECK(!Parses("0 0 30 2 *"));
+    CHECK(!Parses("0 0 31 2 *"));
+    CHECK(!Parses("0 0 31 4,6,9,11 *"));
+    CHECK(!Parses("0 0 30-31 2 *"));
+
+    CHECK(Parses("0 0 29 2 *"));
+    CHECK(Parses("0 0 31 2 1"));
+    CHECK(Parses("0 0 30,31 2,3 *"));
+    CHECK_EQUAL(Next("0 0 31 2 1", Time(2026, 2, 1)), Time(2026, 2, 2));
+    CHECK_EQUAL(Next("0 0 30,31 2,3 *", Time(2026, 2, 1)), Time(2026, 3, 30));
+}
+
+static void TestLeapDay()
+{
+    CHECK_EQUAL(Next("0 0 29 2 *", Time(2025, 3, 1)), Time(2028, 2, 29));
+    CHECK_EQUAL(Next("0 0 29 2 *", Time(2028, 2, 28, 23, 59)), Time(2028, 2, 29));
+    CHECK_EQUAL(Next("0 0 29 2 *", Time(2028, 2, 29)), Time(2032, 2, 29));
+    // 2100 is not a leap year, the next one is 8 years later
+    CHECK_EQUAL(Next("0 0 29 2 *", Time(2099, 3, 1)), Time(2104, 2, 29));
+}
+
+// When both day fields are restricted either one matching is enough
+static void TestDayOrRule()
+{
+    // 2026-03-01 is a Sunday, the 13th is a Friday
+    time_t after = Time(2026, 3, 1);
+    CHECK_EQUAL(Next("0 0 13 * 5", after), Time(2026, 3, 6));
+    CHECK_EQUAL(Next("0 0 13 * 5", Time(2026, 3, 6)), Time(2026, 3, 13));
+    CHECK_EQUAL(Next("0 0 13 * 5", Time(2026, 3, 13)), Time(2026, 3, 20));
+    CHECK_EQUAL(Next("0 0 15 * 1", after), Time(2026, 3, 2));
+    CHECK_EQUAL(Next("0 0 15 * 1", Time(2026, 3, 9)), Time(2026, 3, 15));
+
+    // With one day field unrestricted the other one decides, steps from * count as unrestricted
+    CHECK_EQUAL(Next("0 0 * * 1", after), Time(2026, 3, 2));
+    CHECK_EQUAL(Next("0 0 15 * *", after), Time(2026, 3, 15));
+    CHECK_EQUAL(Next("0 0 */1 * 1", after), Time(2026, 3, 2));
+
+    // Sunday is 0 or 7
+    CHECK_EQUAL(Next("0 12 * * 0", after), Time(2026, 3, 1, 12));
+    CHECK_EQUAL(Next("0 12 * * 7", after), Time(2026, 3, 1, 12));
+}
+
+static void TestTimes()
+{
+    // The next match is strictly after the time given
+    CHECK_EQUAL(Next("* * * * *", Time(2026, 1, 1)), Time(2026, 1, 1, 0, 1));
+    CHECK_EQUAL(Next("* * * * *", Time(2026, 1, 1) + 59), Time(2026, 1, 1, 0, 1));
+    CHECK_EQUAL(Next("0 4 * * *", Time(2026, 1, 1)), Time(2026, 1, 1, 4));
+    CHECK_EQUAL(Next("0 4 * * *", Time(2026, 1, 1, 4)), Time(2026, 1, 2, 4));
+    CHECK_EQUAL(Next("0 0 1 1 *", Time(2026, 12, 31, 23, 59)), Time(2027, 1, 1));
+
+    // Monday the 2nd to Tuesday the 3rd of March 2026
+    const char* steps = "0-59/15 8-20 * * 1-5";
+    CHECK_EQUAL(Next(steps, Time(2026, 3, 1)), Time(2026, 3, 2, 8));
+    CHECK_EQUAL(Next(steps, Time(2026, 3, 2, 8)), Time(2026, 3, 2, 8, 15));
+    CHECK_EQUAL(Next(steps, Time(2026, 3, 2, 20, 30)), Time(2026, 3, 2, 20, 45));
+    CHECK_EQUAL(Next(steps, Time(2026, 3, 2, 20, 45)), Time(2026, 3, 3, 8));
+}
+
+static void TestScheduler()
+{
+    ElunaCronSpec hourly;
+    ElunaCronSpec daily;
+    ElunaCronSpec leapDay;
+    CHECK(hourly.Parse("0 * * * *"));
+    CHECK(daily.Parse("30 0 * * *"));
+    CHECK(leapDay.Parse("0 0 29 2 *"));
+
+    time_t now = Time(2026, 1, 1);
+    ElunaCronScheduler scheduler;
+    CHECK(!scheduler.MayBeDue(now));
+    scheduler.AddEvent(1, daily, daily.Next(now));
+    scheduler.AddEvent(2, hourly, hourly.Next(now));
+    scheduler.AddEvent(3, leapDay, leapDay.Next(now));
+
+    int funcRef = 0;
+    bool expired = false;
+    CHECK(!scheduler.PopDue(now, funcRef, expired));
+    CHECK(!scheduler.MayBeDue(Time(2026, 1, 1, 0, 29)));
+    CHECK(scheduler.MayBeDue(Time(2026, 1, 1, 1)));
+
+    // A missed deadline is called once, the earliest first
+    now = Time(2026, 1, 1, 2);
+    CHECK(scheduler.PopDue(now, funcRef, expired));
+    CHECK_EQUAL(funcRef, 1);
+    CHECK(!expired);
+    CHECK(scheduler.PopDue(now, funcRef, expired));
+    CHECK_EQUAL(funcRef, 2);
+    CHECK(!scheduler.PopDue(now, funcRef, expired));
+    CHECK(!scheduler.IsDue(now));
+    CHECK(scheduler.IsDue(Time(2026, 1, 1, 3)));
+
+    CHECK(scheduler.RemoveEvent(2));
+    CHECK(!scheduler.RemoveEvent(2));
+    CHECK(!scheduler.IsDue(Time(2026, 1, 1, 3)));
+    CHECK(scheduler.IsDue(Time(2026, 1, 2, 0, 30)));
+
+    scheduler.Clear();
+    CHECK(!scheduler.MayBeDue(Time(2030, 1, 1)));
+}
+
+int main()
+{
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    TestSyntax();
+    TestImpossibleSpecs();
+    TestLeapDay();
+    TestDayOrRule();
+    TestTimes();
+    TestScheduler();
+
+    if (!testFailures)
+        printf("CronTest passed\n");
+    return testFailures;
+}
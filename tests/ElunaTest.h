@@ -0,0 +1,37 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _ELUNA_TEST_H
+#define _ELUNA_TEST_H
+
+#include <cstdio>
+
+// Failed checks are printed and counted, main returns the count so ctest sees the failure
+static int testFailures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++testFailures; \
+        } \
+    } while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+    do \
+    { \
+        long long _actual = (long long)(actual); \
+        long long _expected = (long long)(expected); \
+        if (_actual != _expected) \
+        { \
+            printf("%s:%d: check failed: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, _actual, _expected); \
+            ++testFailures; \
+        } \
+    } while (0)
+
+#endif
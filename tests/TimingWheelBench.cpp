@@ -0,0 +1,81 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaTimingWheel.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// Schedules a million events with delays up to a minute, like the timed events of a busy server,
+// and advances the wheel in 50 ms world updates while every call reschedules its event once.
+
+struct BenchEvent
+{
+    BenchEvent() : due(0), next(0), repeats(0) { }
+    uint64 due;
+    uint32 next;
+    uint32 repeats;
+};
+
+typedef ElunaTimingWheel<BenchEvent> Wheel;
+
+struct BenchCaller
+{
+    BenchCaller(Wheel& wheel, std::vector<BenchEvent>& events, uint64& now) : wheel(wheel), events(events), now(now), calls(0) { }
+
+    bool CanCall(uint32 /*index*/) { return true; }
+
+    void Call(uint32 index)
+    {
+        ++calls;
+        if (events[index].repeats)
+        {
+            --events[index].repeats;
+            events[index].due = now + 1 + rand() % 60000;
+            wheel.Schedule(events, index, now);
+        }
+    }
+
+    Wheel& wheel;
+    std::vector<BenchEvent>& events;
+    uint64& now;
+    uint32 calls;
+};
+
+int main(int argc, char** argv)
+{
+    const uint32 count = argc > 1 ? uint32(atoi(argv[1])) : 1000000;
+    srand(42);
+
+    Wheel wheel;
+    std::vector<BenchEvent> events(count);
+    uint64 now = 0;
+    BenchCaller caller(wheel, events, now);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for (uint32 i = 0; i < count; ++i)
+    {
+        events[i].due = now + 1 + rand() % 60000;
+        events[i].repeats = 1;
+        wheel.Schedule(events, i, now);
+    }
+    Clock::time_point scheduled = Clock::now();
+
+    uint32 updates = 0;
+    while (!wheel.IsEmpty())
+    {
+        wheel.Advance(events, now, now + 50, caller);
+        ++updates;
+    }
+    Clock::time_point end = Clock::now();
+
+    double scheduleMs = std::chrono::duration<double, std::milli>(scheduled - start).count();
+    double advanceMs = std::chrono::duration<double, std::milli>(end - scheduled).count();
+    printf("%u events scheduled in %.1f ms\n", count, scheduleMs);
+    printf("%u calls over %u updates in %.1f ms, %.1f ns per call\n", caller.calls, updates, advanceMs, advanceMs * 1e6 / caller.calls);
+    return caller.calls == 2 * count ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ElunaTest.h"
+#include "ElunaTimingWheel.h"
+#include <cstdlib>
+
+struct TestEvent
+{
+    TestEvent() : due(0), next(0), seq(0), calledAt(0), reschedules(0) { }
+    uint64 due;
+    uint32 next;
+    uint32 seq;         // Order the event was scheduled in
+    uint64 calledAt;
+    uint32 reschedules; // Times the event schedules itself again when called, delay is due - previous due
+};
+
+typedef ElunaTimingWheel<TestEvent> Wheel;
+
+// Records the calls and checks each one is made on its due time and after the events due before it
+struct TestCaller
+{
+    TestCaller(Wheel& wheel, std::vector<TestEvent>& events, uint64& now) :
+        wheel(wheel), events(events), now(now), budget(0xFFFFFFFF), seq(0), lastDue(0), lastSeq(0)
+    {
+    }
+
+    bool CanCall(uint32 /*index*/)
+    {
+        if (!budget)
+            return false;
+        --budget;
+        return true;
+    }
+
+    void Call(uint32 index)
+    {
+        TestEvent& event = events[index];
+        CHECK_EQUAL(event.due, now);
+        CHECK(event.due > lastDue || (event.due == lastDue && event.seq > lastSeq) || called.empty());
+        lastDue = event.due;
+        lastSeq = event.seq;
+        event.calledAt = now;
+        called.push_back(index);
+
+        if (event.reschedules)
+        {
+            --events[index].reschedules;
+            uint64 delay = 1 + uint64(rand() % 2000);
+            events[index].due = now + delay;
+            events[index].seq = ++seq;
+            wheel.Schedule(events, index, now);
+        }
+    }
+
+    Wheel& wheel;
+    std::vector<TestEvent>& events;
+    uint64& now;
+    uint32 budget;  // Calls allowed before CanCall returns false
+    uint32 seq;
+    uint64 lastDue;
+    uint32 lastSeq;
+    std::vector<uint32> called;
+};
+
+static uint32 Add(Wheel& wheel, std::vector<TestEvent>& events, TestCaller& caller, uint64 now, uint64 due)
+{
+    TestEvent event;
+    event.due = due;
+    event.seq = ++caller.seq;
+    events.push_back(event);
+    wheel.Schedule(events, uint32(events.size() - 1), now);
+    return uint32(events.size() - 1);
+}
+
+// Each event is called exactly on its due time when it sits on a level boundary
+static void TestLevelBoundaries(uint64 start)
+{
+    const uint64 delays[] =
+    {
+        1, 2, 31, 32, 33, 63, 64, 65, 1023, 1024, 1025, 1056, 32767, 32768, 32769,
+        (1 << 20) - 1, 1 << 20, (1 << 20) + 1, (1 << 20) + 32, (1 << 25) + 7
+    };
+    const size_t count = sizeof(delays) / sizeof(delays[0]);
+
+    Wheel wheel;
+    std::vector<TestEvent> events;
+    uint64 now = start;
+    TestCaller caller(wheel, events, now);
+    for (size_t i = 0; i < count; ++i)
+        Add(wheel, events, caller, now, start + delays[i]);
+
+    // Advance in uneven steps so some targets fall inside skipped ranges
+    while (caller.called.size() < count && now < start + (1 << 26))
+        CHECK(wheel.Advance(events, now, now + 777 + (now % 13), caller));
+
+    CHECK_EQUAL(caller.called.size(), count);
+    CHECK(wheel.IsEmpty());
+    for (size_t i = 0; i < count && i < caller.called.size(); ++i)
+        CHECK_EQUAL(caller.called[i], i);
+}
+
+// Events past the last level wait in overflow and come back down when the top level wraps
+static void TestOverflow()
+{
+    Wheel wheel;
+    std::vector<TestEvent> events;
+    uint64 now = 5;
+    TestCaller caller(wheel, events, now);
+
+    const uint64 top = uint64(1) << (Wheel::WHEEL_BITS * Wheel::WHEEL_LEVELS);
+    uint32 late = Add(wheel, events, caller, now, now + 3 * top + 17);
+    uint32 early = Add(wheel, events, caller, now, now + top + 1);
+    uint32 same = Add(wheel, events, caller, now, now + 3 * top + 17);
+
+    CHECK(wheel.Advance(events, now, 3 * top, caller));
+    CHECK_EQUAL(caller.called.size(), 1);
+    CHECK_EQUAL(events[early].calledAt, 5 + top + 1);
+
+    CHECK(wheel.Advance(events, now, 4 * top, caller));
+    CHECK_EQUAL(caller.called.size(), 3);
+    CHECK_EQUAL(events[late].calledAt, 5 + 3 * top + 17);
+    CHECK_EQUAL(events[same].calledAt, 5 + 3 * top + 17);
+    CHECK(wheel.IsEmpty());
+    CHECK_EQUAL(now, 4 * top);
+}
+
+// Events due at the same time are called in the order they were scheduled, also after cascading from any level
+static void TestSameDueOrder()
+{
+    const uint64 dues[] = { 40, 1100, 40000, 1100000, 2000000 };
+    for (size_t d = 0; d < sizeof(dues) / sizeof(dues[0]); ++d)
+    {
+        Wheel wheel;
+        std::vector<TestEvent> events;
+        uint64 now = 0;
+        TestCaller caller(wheel, events, now);
+
+        // Schedule at different times so the events start out on different levels
+        for (uint32 i = 0; i < 4; ++i)
+            Add(wheel, events, caller, now, dues[d]);
+        CHECK(wheel.Advance(events, now, dues[d] - 33, caller));
+        for (uint32 i = 0; i < 4; ++i)
+            Add(wheel, events, caller, now, dues[d]);
+        CHECK(wheel.Advance(events, now, dues[d] - 2, caller));
+        for (uint32 i = 0; i < 4; ++i)
+            Add(wheel, events, caller, now, dues[d]);
+        CHECK(wheel.Advance(events, now, dues[d], caller));
+
+        CHECK_EQUAL(caller.called.size(), 12);
+        for (uint32 i = 0; i < caller.called.size(); ++i)
+            CHECK_EQUAL(caller.called[i], i);
+    }
+}
+
+// Stopping on the budget leaves the rest due, the next Advance calls them first and then continues in order
+static void TestBudgetSpillover()
+{
+    Wheel wheel;
+    std::vector<TestEvent> events;
+    uint64 now = 0;
+    TestCaller caller(wheel, events, now);
+
+    for (uint32 i = 0; i < 5; ++i)
+        Add(wheel, events, caller, now, 10);
+    for (uint32 i = 0; i < 3; ++i)
+        Add(wheel, events, caller, now, 50);
+    Add(wheel, events, caller, now, 2000);
+
+    caller.budget = 2;
+    CHECK(!wheel.Advance(events, now, 3000, caller));
+    CHECK_EQUAL(now, 10);
+    CHECK_EQUAL(caller.called.size(), 2);
+    CHECK(!wheel.IsEmpty());
+
+    // Out of budget before anything is called, nothing moves
+    caller.budget = 0;
+    CHECK(!wheel.Advance(events, now, 3000, caller));
+    CHECK_EQUAL(now, 10);
+    CHECK_EQUAL(caller.called.size(), 2);
+
+    // An event scheduled meanwhile right after the time reached is called after the ones left due
+    uint32 added = Add(wheel, events, caller, now, 11);
+    caller.budget = 4;
+    CHECK(!wheel.Advance(events, now, 3000, caller));
+    CHECK_EQUAL(now, 50);
+    CHECK_EQUAL(caller.called.size(), 6);
+
+    caller.budget = 0xFFFFFFFF;
+    CHECK(wheel.Advance(events, now, 3000, caller));
+    CHECK_EQUAL(now, 3000);
+
+    const uint32 order[] = { 0, 1, 2, 3, 4, added, 5, 6, 7, 8 };
+    CHECK_EQUAL(caller.called.size(), 10);
+    for (uint32 i = 0; i < caller.called.size() && i < 10; ++i)
+        CHECK_EQUAL(caller.called[i], order[i]);
+    CHECK(wheel.IsEmpty());
+}
+
+// Random delays, reschedules during calls and budget stops, checked against due time and schedule order
+static void TestRandom()
+{
+    srand(1234);
+    Wheel wheel;
+    std::vector<TestEvent> events;
+    uint64 now = 123456789;
+    TestCaller caller(wheel, events, now);
+
+    const uint32 count = 20000;
+    uint32 expectedCalls = 0;
+    for (uint32 i = 0; i < count; ++i)
+    {
+        uint64 delay;
+        switch (rand() % 4)
+        {
+            case 0: delay = 1 + rand() % 32; break;
+            case 1: delay = 1 + rand() % 1024; break;
+            case 2: delay = 1 + rand() % 200000; break;
+            default: delay = 1 + uint64(rand() % 2000) * 1000; break;
+        }
+        uint32 index = Add(wheel, events, caller, now, now + delay);
+        events[index].reschedules = rand() % 3;
+        expectedCalls += 1 + events[index].reschedules;
+    }
+
+    uint64 end = now + 4000000;
+    while (now < end)
+    {
+        caller.budget = 1 + rand() % 500;
+        wheel.Advance(events, now, now + 1 + rand() % 5000, caller);
+    }
+
+    CHECK_EQUAL(caller.called.size(), expectedCalls);
+    CHECK(wheel.IsEmpty());
+}
+
+int main()
+{
+    TestLevelBoundaries(0);
+    TestLevelBoundaries(1000);
+    TestLevelBoundaries((uint64(1) << 20) - 3);
+    TestOverflow();
+    TestSameDueOrder();
+    TestBudgetSpillover();
+    TestRandom();
+
+    if (!testFailures)
+        printf("TimingWheelTest passed\n");
+    return testFailures;
+}
@@ -0,0 +1,23 @@
+/*
+* Copyright (C) 2010 - 2015 Eluna Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+// Stands in for the core's Define.h, the tests only need its integer types
+
+#ifndef _ELUNA_TESTS_DEFINE_H
+#define _ELUNA_TESTS_DEFINE_H
+
+#include <cstdint>
+
+typedef int64_t int64;
+typedef int32_t int32;
+typedef int16_t int16;
+typedef int8_t int8;
+typedef uint64_t uint64;
+typedef uint32_t uint32;
+typedef uint16_t uint16;
+typedef uint8_t uint8;
+
+#endif